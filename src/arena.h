@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Size of the chunks allocations are carved out of
+#ifndef ARENA_CHUNK_SIZE
+#define ARENA_CHUNK_SIZE 65536
+#endif
+
+// Alignment of every allocation
+#define ARENA_ALIGN 16
+
+//
+// Bump allocator: allocations are carved out of chunks one after the other,
+// and are only freed all at once, with the arena. Ones larger than a quarter
+// of a chunk get a chunk of their own.
+//
+
+typedef struct ArenaChunk ArenaChunk;
+// NOTE: the header keeps data aligned like malloc's result
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t     size;   // Size of data
+    char       data[];
+};
+
+typedef struct Arena Arena;
+struct Arena {
+    ArenaChunk *chunks; // Chunks, the one being carved out of first
+    char       *ptr;    // Free space of the first chunk
+    char       *end;
+    size_t     size;    // Bytes allocated from it
+};
+
+static inline void arena_init(Arena *self)
+{
+    self->chunks = NULL;
+    self->ptr = self->end = NULL;
+    self->size = 0;
+}
+
+static inline void arena_free(Arena *self)
+{
+    for (ArenaChunk *chunk = self->chunks; chunk; ) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena_init(self);
+}
+
+// Allocate zeroed memory
+static inline void *arena_alloc(Arena *self, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    self->size += size;
+    if (size > ARENA_CHUNK_SIZE / 4) {
+        // Keep carving out of the first chunk
+        ArenaChunk *chunk = calloc(1, sizeof *chunk + size);
+        chunk->size = size;
+        if (self->chunks) {
+            chunk->next = self->chunks->next;
+            self->chunks->next = chunk;
+        } else {
+            self->chunks = chunk;
+        }
+        return chunk->data;
+    }
+    if ((size_t) (self->end - self->ptr) < size) {
+        ArenaChunk *chunk = malloc(sizeof *chunk + ARENA_CHUNK_SIZE);
+        chunk->size = ARENA_CHUNK_SIZE;
+        chunk->next = self->chunks;
+        self->chunks = chunk;
+        self->ptr = chunk->data;
+        self->end = chunk->data + ARENA_CHUNK_SIZE;
+    }
+    void *ptr = self->ptr;
+    self->ptr += size;
+    return memset(ptr, 0, size);
+}
+
+static inline char *arena_strdup(Arena *self, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    return memcpy(arena_alloc(self, len), str, len);
+}
+
+#endif
@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+// Minimum number of slots
+#ifndef HASH_MINSIZE
+#define HASH_MINSIZE 16
+#endif
+
+// Maximum load factor before growing, in eighths
+#ifndef HASH_MAXLOAD
+#define HASH_MAXLOAD 7
+#endif
+
+//
+// Hash functions for common key types
+//
+
+static inline size_t hash_str(const char *str)
+{
+    // FNV-1a
+    size_t hash = 14695981039346656037UL;
+    for (; *str; ++str)
+        hash = (hash ^ (unsigned char) *str) * 1099511628211UL;
+    return hash;
+}
+
+static inline size_t hash_ptr(const void *ptr)
+{
+    // Fibonacci hashing, the low bits of pointers are mostly zero
+    return ((size_t) ptr >> 3) * 11400714819323198485UL;
+}
+
+static inline _Bool hash_str_eq(const char *a, const char *b)
+{
+    return !strcmp(a, b);
+}
+
+static inline _Bool hash_ptr_eq(const void *a, const void *b)
+{
+    return a == b;
+}
+
+//
+// Generate type specific definitions of a hash map
+//
+// Entries are kept in a single array, with open addressing and Robin Hood
+// probing: an entry is never further from its home slot than the entries
+// it passes, so lookups can stop early, and removing an entry shifts the
+// ones after it back instead of leaving a tombstone. The full hash of each
+// entry is kept with it (0 marks an empty slot), so equality is only
+// checked for entries with the same hash, and growing doesn't rehash keys.
+//
+// Entries move on insertion and removal, pointers to values are only valid
+// until the next one. The slots can be walked over with:
+//
+//     for (size_t i = 0; i < map.size; ++i)
+//         if (map.arr[i].hash)
+//             ... map.arr[i].key, map.arr[i].value ...
+//
+#define HASH_GEN(key_type, value_type, stru_name, fn_pre, hash_fn, eq_fn)      \
+                                                                               \
+typedef struct {                                                               \
+    size_t     hash;  /* Hash of the key, 0 if the slot is empty */            \
+    key_type   key;                                                            \
+    value_type value;                                                          \
+} stru_name##Entry;                                                            \
+                                                                               \
+typedef struct {                                                               \
+    size_t           n;    /* Number of entries */                             \
+    size_t           size; /* Number of slots, 0 or a power of 2 */            \
+    stru_name##Entry *arr; /* The slots */                                     \
+} stru_name;                                                                   \
+                                                                               \
+static inline void fn_pre##_init(stru_name *self)                              \
+{                                                                              \
+    self->n = 0;                                                               \
+    self->size = 0;                                                            \
+    self->arr = NULL;                                                          \
+}                                                                              \
+                                                                               \
+static inline void fn_pre##_free(stru_name *self)                              \
+{                                                                              \
+    free(self->arr);                                                           \
+}                                                                              \
+                                                                               \
+static inline size_t fn_pre##_hash(key_type key)                               \
+{                                                                              \
+    size_t hash = hash_fn(key);                                                \
+    return hash ? hash : 1;                                                    \
+}                                                                              \
+                                                                               \
+/* Distance of the entry in a slot from its home slot */                       \
+static inline size_t fn_pre##_dist(stru_name *self, size_t i)                  \
+{                                                                              \
+    return (i - self->arr[i].hash) & (self->size - 1);                         \
+}                                                                              \
+                                                                               \
+/* Place an entry known not to be in the map, returns its slot */              \
+static inline size_t fn_pre##_place(stru_name *self, stru_name##Entry entry)   \
+{                                                                              \
+    size_t mask = self->size - 1, placed = (size_t) -1, dist = 0;              \
+    for (size_t i = entry.hash & mask;; i = (i + 1) & mask, ++dist) {          \
+        if (!self->arr[i].hash) {                                              \
+            self->arr[i] = entry;                                              \
+            return placed == (size_t) -1 ? i : placed;                         \
+        }                                                                      \
+        /* Take the slot of an entry closer to its home, and go on placing */  \
+        /* that one instead */                                                 \
+        size_t other = fn_pre##_dist(self, i);                                 \
+        if (other < dist) {                                                    \
+            stru_name##Entry tmp = self->arr[i];                               \
+            self->arr[i] = entry;                                              \
+            entry = tmp;                                                       \
+            dist = other;                                                      \
+            if (placed == (size_t) -1)                                         \
+                placed = i;                                                    \
+        }                                                                      \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+/* Make room for n entries without growing */                                  \
+static inline void fn_pre##_reserve(stru_name *self, size_t n)                 \
+{                                                                              \
+    size_t size = self->size ? self->size : HASH_MINSIZE;                      \
+    while (n * 8 > size * HASH_MAXLOAD)                                        \
+        size *= 2;                                                             \
+    if (size == self->size)                                                    \
+        return;                                                                \
+                                                                               \
+    stru_name##Entry *old = self->arr;                                         \
+    size_t old_size = self->size;                                              \
+    self->size = size;                                                         \
+    self->arr = calloc(size, sizeof *self->arr);                               \
+    for (size_t i = 0; i < old_size; ++i)                                      \
+        if (old[i].hash)                                                       \
+            fn_pre##_place(self, old[i]);                                      \
+    free(old);                                                                 \
+}                                                                              \
+                                                                               \
+/* Slot of the entry with a key, or -1 */                                      \
+static inline ssize_t fn_pre##_slot(stru_name *self, key_type key)             \
+{                                                                              \
+    if (!self->n)                                                              \
+        return -1;                                                             \
+    size_t hash = fn_pre##_hash(key), mask = self->size - 1, dist = 0;         \
+    for (size_t i = hash & mask;; i = (i + 1) & mask, ++dist) {                \
+        /* The entry would have taken the slot of one closer to its home */    \
+        if (!self->arr[i].hash || fn_pre##_dist(self, i) < dist)               \
+            return -1;                                                         \
+        if (self->arr[i].hash == hash && eq_fn(self->arr[i].key, key))         \
+            return i;                                                          \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static inline value_type *fn_pre##_find(stru_name *self, key_type key)         \
+{                                                                              \
+    ssize_t i = fn_pre##_slot(self, key);                                      \
+    return i < 0 ? NULL : &self->arr[i].value;                                 \
+}                                                                              \
+                                                                               \
+/* Add an entry, or replace the key and value of the one with an equal key */  \
+static inline value_type *fn_pre##_put(stru_name *self, key_type key,          \
+    value_type value)                                                          \
+{                                                                              \
+    ssize_t i = fn_pre##_slot(self, key);                                      \
+    if (i >= 0) {                                                              \
+        self->arr[i].key = key;                                                \
+        self->arr[i].value = value;                                            \
+        return &self->arr[i].value;                                            \
+    }                                                                          \
+    fn_pre##_reserve(self, ++self->n);                                         \
+    i = fn_pre##_place(self,                                                   \
+        (stru_name##Entry) { fn_pre##_hash(key), key, value });                \
+    return &self->arr[i].value;                                                \
+}                                                                              \
+                                                                               \
+/* Remove the entry with a key, copying it to removed (if not NULL) */         \
+static inline _Bool fn_pre##_remove(stru_name *self, key_type key,             \
+    stru_name##Entry *removed)                                                 \
+{                                                                              \
+    ssize_t i = fn_pre##_slot(self, key);                                      \
+    if (i < 0)                                                                 \
+        return 0;                                                              \
+    if (removed)                                                               \
+        *removed = self->arr[i];                                               \
+    --self->n;                                                                 \
+    /* Shift back the entries after it, up to one in its home slot */          \
+    size_t mask = self->size - 1, j = (i + 1) & mask;                          \
+    for (; self->arr[j].hash && fn_pre##_dist(self, j); j = (j + 1) & mask) {  \
+        self->arr[i] = self->arr[j];                                           \
+        i = j;                                                                 \
+    }                                                                          \
+    self->arr[i].hash = 0;                                                     \
+    return 1;                                                                  \
+}
+
+#endif
@@ -5,7 +5,9 @@
 //
 
 #include <assert.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <vec.h>
 #include "token.h"
 #include "lex.h"
@@ -29,6 +31,8 @@ struct LexCtx {
         FILE *fp;
         const char *str;
     };
+    // Start of the string
+    const char *base;
 
     // Buffered characters
     int ch1, ch2;
@@ -111,9 +115,19 @@ static _Bool lex_match2(LexCtx *ctx, int want1, int want2)
 
 LexCtx *lex_open_file(const char *path)
 {
-    FILE *fp = fopen(path, "r");
-    if (!fp)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
         return NULL;
+    return lex_open_fd(path, fd);
+}
+
+LexCtx *lex_open_fd(const char *path, int fd)
+{
+    FILE *fp = fdopen(fd, "r");
+    if (!fp) {
+        close(fd);
+        return NULL;
+    }
 
     LexCtx *ctx = calloc(1, sizeof *ctx);
     ctx->path = strdup(path);
@@ -137,6 +151,7 @@ LexCtx *lex_open_string(const char *path, const char *str)
 
     ctx->type = LEX_STR;
     ctx->str = str;
+    ctx->base = str;
 
     ctx->ch1 = lex_readc(ctx, &ctx->ch1_lines);
     ctx->ch2 = lex_readc(ctx, &ctx->ch2_lines);
@@ -153,6 +168,34 @@ size_t lex_line(LexCtx *ctx)
     return ctx->line;
 }
 
+_Bool lex_tell(LexCtx *ctx, LexPos *pos)
+{
+    if (ctx->type != LEX_STR)
+        return 0;
+    *pos = (LexPos) {
+        .offset = ctx->str - ctx->base,
+        .line = ctx->line,
+        .directive = ctx->directive,
+        .ch1 = ctx->ch1,
+        .ch2 = ctx->ch2,
+        .ch1_lines = ctx->ch1_lines,
+        .ch2_lines = ctx->ch2_lines,
+    };
+    return 1;
+}
+
+void lex_seek(LexCtx *ctx, const LexPos *pos)
+{
+    assert(ctx->type == LEX_STR);
+    ctx->str = ctx->base + pos->offset;
+    ctx->line = pos->line;
+    ctx->directive = pos->directive;
+    ctx->ch1 = pos->ch1;
+    ctx->ch2 = pos->ch2;
+    ctx->ch1_lines = pos->ch1_lines;
+    ctx->ch2_lines = pos->ch2_lines;
+}
+
 void lex_free(LexCtx *ctx)
 {
     if (ctx->type == LEX_FILE)
@@ -496,3 +539,63 @@ whitespace:
 
     return create_token(TK_OTHER, flags, other(ctx));
 }
+
+void lex_skip_line(LexCtx *ctx)
+{
+    int quote;
+
+    for (;;)
+        switch (ctx->ch1) {
+        case EOF:
+            return;
+        case '\n':
+            lex_fwd(ctx);
+            ctx->directive = 1;
+            return;
+        case '\'':
+        case '\"':
+            // Literals can contain comment starts
+            quote = ctx->ch1;
+            lex_fwd(ctx);
+            while (ctx->ch1 != quote && ctx->ch1 != '\n' && ctx->ch1 != EOF) {
+                if (ctx->ch1 == '\\')
+                    lex_fwd(ctx);
+                lex_fwd(ctx);
+            }
+            lex_match1(ctx, quote);
+            break;
+        case '/':
+            if (ctx->ch2 == '/') {
+                while (ctx->ch1 != '\n' && ctx->ch1 != EOF)
+                    lex_fwd(ctx);
+                break;
+            }
+            if (ctx->ch2 == '*') {
+                // Block comments can continue on the next lines
+                lex_fwd(ctx);
+                lex_fwd(ctx);
+                while (ctx->ch1 != EOF && !lex_match2(ctx, '*', '/'))
+                    lex_fwd(ctx);
+                break;
+            }
+            // FALLTHRU
+        default:
+            lex_fwd(ctx);
+        }
+}
+
+Token *lex_one(const char *str)
+{
+    // NOTE: there is no need for a path or a heap allocated context here
+    LexCtx ctx = { .line = 1, .type = LEX_STR, .str = str };
+    ctx.ch1 = lex_readc(&ctx, &ctx.ch1_lines);
+    ctx.ch2 = lex_readc(&ctx, &ctx.ch2_lines);
+
+    Token *token = lex_next(&ctx);
+    // Characters left after the first token means more than one token
+    if (token && ctx.ch1 != EOF) {
+        free_token(token);
+        return NULL;
+    }
+    return token;
+}
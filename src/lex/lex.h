@@ -10,6 +10,12 @@ typedef struct LexCtx LexCtx;
 //
 LexCtx *lex_open_file(const char *path);
 
+//
+// Open a lexer context for a file already open at fd, which it takes over,
+// path is the file's path to report
+//
+LexCtx *lex_open_fd(const char *path, int fd);
+
 //
 // Open a lexer context for an in-memory string
 //
@@ -35,4 +41,36 @@ void lex_free(LexCtx *ctx);
 //
 Token *lex_next(LexCtx *ctx);
 
+//
+// Saved state of a lexer context reading a string
+//
+typedef struct {
+    size_t  offset;     // Offset of the next character read
+    size_t  line;       // Line number
+    _Bool   directive;  // Is the next token a directive?
+    int     ch1, ch2;   // Buffered characters
+    int     ch1_lines, ch2_lines;
+} LexPos;
+
+//
+// Save the state of a lexer context, returns 0 if it's reading a file
+//
+_Bool lex_tell(LexCtx *ctx, LexPos *pos);
+
+//
+// Return to a state saved from a context reading the same string
+//
+void lex_seek(LexCtx *ctx, const LexPos *pos);
+
+//
+// Skip the rest of the current line without creating tokens
+//
+void lex_skip_line(LexCtx *ctx);
+
+//
+// Lex a string that must make up exactly one token (e.g. the result of ##),
+// returns NULL if it doesn't
+//
+Token *lex_one(const char *str);
+
 #endif
@@ -19,17 +19,38 @@ Token *create_token(TokenType type, TokenFlags flags, char *data)
     token->type = type;
     token->flags = flags;
     token->data = data;
+    token->refs = 1;
     return token;
 }
 
 Token *dup_token(Token *token)
 {
-    return create_token(token->type, token->flags,
+    Token *copy = create_token(token->type, token->flags,
         token->data ? strdup(token->data) : NULL);
+    copy->hideset = token->hideset;
+    return copy;
+}
+
+Token *ref_token(Token *token)
+{
+    ++token->refs;
+    return token;
+}
+
+Token *unshare_token(Token *token)
+{
+    if (token->refs == 1)
+        return token;
+    // Copy-on-write: the other references keep seeing the original
+    Token *copy = dup_token(token);
+    --token->refs;
+    return copy;
 }
 
 void free_token(Token *token)
 {
+    if (--token->refs)
+        return;
     if (token->data)
         free(token->data);
     free(token);
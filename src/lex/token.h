@@ -65,7 +65,6 @@ typedef enum {
 typedef struct {
     _Bool lwhite    : 1; // Is there whitespace to the left
     _Bool directive : 1; // Was this token at the beginning of a line
-    _Bool no_expand : 1; // Token can't expand anymore
 } TokenFlags;
 
 #define TOKEN_NOFLAGS (TokenFlags) { 0 }
@@ -75,13 +74,20 @@ typedef struct {
     TokenType type;   // Type of token
     TokenFlags flags; // Various token flags (used by the pre-processor)
     char *data;       // String data from the lexer
+    unsigned refs;    // Reference count
+    // Macros that can't expand this token (used by the pre-processor)
+    struct Hideset *hideset;
 } Token;
 
 // Create a new token
 Token *create_token(TokenType type, TokenFlags flags, char *data);
 // Create a duplicate of a token
 Token *dup_token(Token *token);
-// Free a token
+// Take a new reference to a token (tokens are shared read-only)
+Token *ref_token(Token *token);
+// Make sure a token isn't shared before modifying it
+Token *unshare_token(Token *token);
+// Drop a reference to a token, freeing it with the last one
 void free_token(Token *token);
 
 const char *token_spelling(Token *token);
@@ -1,76 +1,574 @@
 // SPDX-License-Identifier: GPL-2.0-only
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <unistd.h>
 #include <vec.h>
 #include <lex/token.h>
 #include <pp/pp.h>
 #include <target.h>
 #include <parse/parse.h>
+#include "server.h"
 
-static void do_preprocess(PpContext *pp)
+// Search directory from the environment
+typedef struct {
+    char *path;
+    _Bool system;
+} EnvDir;
+
+// Options shared by every translation unit
+typedef struct {
+    // Directory relative paths are from
+    int dirfd;
+    // Extra header search directories (-I)
+    const char **search_dirs;
+    size_t nsearch_dirs;
+    // Search directories of CPATH, then system ones of C_INCLUDE_PATH
+    EnvDir *env_dirs;
+    size_t nenv_dirs;
+
+    _Bool eflag, hflag, stats;
+    // Macro profile (-fpp-profile), as JSON with -fpp-profile=json
+    _Bool profile, profile_json;
+    // Size limit of the memoized macro invocations (0 disables them)
+    size_t memo_budget;
+    // Pre-process on a thread of its own (-fpp-pipeline)
+    _Bool pipeline;
+    // Dependency output: mflag stops after it, mdflag has it alongside the
+    // normal output, dep_system includes system headers
+    _Bool mflag, mdflag, dep_system;
+    const char *dep_path, *dep_target;
+} Options;
+
+static void do_compile(PpContext *pp, _Bool pipeline)
+{
+    PpPipe *pipe = pipeline ? pp_pipe_start(pp) : NULL;
+    ParseCtx *parse = pipe ? parse_create_pipe(pipe) : parse_create(pp);
+    parse_run(parse);
+    parse_free(parse);
+    if (pipe)
+        pp_pipe_free(pipe);
+}
+
+// Replace the directory and suffix of path
+static char *replace_suffix(const char *path, const char *suffix)
+{
+    const char *base = strrchr(path, '/'), *dot;
+    base = base ? base + 1 : path;
+    if (!(dot = strrchr(base, '.')))
+        dot = base + strlen(base);
+
+    char *result;
+    if (asprintf(&result, "%.*s%s", (int) (dot - base), base, suffix) < 0)
+        abort();
+    return result;
+}
+
+// Open a file for writing, relative to the directory open at dirfd
+static FILE *create_at(int dirfd, const char *path)
+{
+    int fd = openat(dirfd, path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return NULL;
+    FILE *fp = fdopen(fd, "w");
+    if (!fp)
+        close(fd);
+    return fp;
+}
+
+// Write the dependencies of the input file, to out unless path is given
+static int write_deps(PpContext *pp, const Options *opts, const char *input,
+                      const char *path, FILE *out, FILE *err)
 {
-    Token *token;
+    const char *target = opts->dep_target;
+    char *default_target = NULL;
+    if (!target)
+        target = default_target = replace_suffix(input, ".o");
 
-    while ((token = pp_next(pp))) {
-        if (token->flags.lwhite)
-            putchar(' ');
-        fputs(token_spelling(token), stdout);
-        free_token(token);
+    FILE *fp = path ? create_at(opts->dirfd, path) : out;
+    if (!fp) {
+        fprintf(err, "%s: %s\n", path, strerror(errno));
+        free(default_target);
+        return -1;
     }
+    pp_write_deps(pp, fp, target, opts->dep_system);
+    if (fp != out)
+        fclose(fp);
+    free(default_target);
+    return 0;
 }
 
-static void do_compile(PpContext *pp)
+// Number of headers in the summary of -H
+#define TOP_HEADERS 10
+
+// Default size limit of the file cache (MiB)
+#define CACHE_BUDGET 256
+
+// Running as a server: the file cache is shared by the clients, its size
+// limit is set when the server starts
+static _Bool serving;
+
+// Number of macros in the summary of memoized invocations
+#define TOP_MEMO_MACROS 10
+
+// Return to run_unit when a translation unit has an error
+static void unit_error(void *arg)
 {
-    ParseCtx *parse = parse_create(pp);
-    parse_run(parse);
-    parse_free(parse);
+    longjmp(*(jmp_buf *) arg, 1);
 }
 
-int main(int argc, char *argv[])
+// Process one translation unit, an error in it only ends the unit itself
+static int run_unit(const Options *opts, const char *input, FILE *out, FILE *err)
 {
     PpContext *pp = pp_create();
-    pp_add_search_dir(pp, "include");
-    pp_add_search_dir(pp, "/usr/include");
-    pp_add_search_dir(pp, "/usr/include/x86_64-linux-gnu");
-    pp_add_search_dir(pp, "/usr/local/include");
+    // NOTE: volatile as it's assigned between setjmp and longjmp
+    char *volatile default_path = NULL;
+    jmp_buf env;
+    int result;
+
+    if (setjmp(env)) {
+        result = 1;
+        goto end;
+    }
+    pp_set_err(pp, err, unit_error, &env);
+    pp_set_dir(pp, opts->dirfd);
+
+    pp_add_system_dir(pp, "include");
+    pp_add_system_dir(pp, "/usr/include");
+    pp_add_system_dir(pp, "/usr/include/x86_64-linux-gnu");
+    pp_add_system_dir(pp, "/usr/local/include");
+    for (size_t i = 0; i < opts->nsearch_dirs; ++i)
+        pp_add_search_dir(pp, opts->search_dirs[i]);
+    for (size_t i = 0; i < opts->nenv_dirs; ++i)
+        if (opts->env_dirs[i].system)
+            pp_add_system_dir(pp, opts->env_dirs[i].path);
+        else
+            pp_add_search_dir(pp, opts->env_dirs[i].path);
+    if (opts->hflag)
+        pp_report_includes(pp);
+    pp_memo_enable(pp, opts->memo_budget);
+    if (opts->profile)
+        pp_profile_macros(pp);
+
+    result = 1;
+    if (pp_push_file(pp, input) < 0) {
+        fprintf(err, "%s: %s\n", input, strerror(errno));
+        goto end;
+    }
+
+    if (opts->mflag) {
+        // Only the directives matter for finding dependencies
+        pp_scan(pp);
+        if (write_deps(pp, opts, input, opts->dep_path, out, err) < 0)
+            goto end;
+    } else {
+        int written = 0, error = 0;
+        if (opts->eflag && opts->pipeline) {
+            fflush(out);
+            PpPipe *pipe = pp_pipe_start(pp);
+            if ((written = pp_write_pipe(pipe, fileno(out))) < 0)
+                error = errno;
+            pp_pipe_free(pipe);
+        } else if (opts->eflag) {
+            fflush(out);
+            if ((written = pp_write(pp, fileno(out))) < 0)
+                error = errno;
+        } else {
+            do_compile(pp, opts->pipeline);
+        }
+        if (written < 0) {
+            fprintf(err, "%s: Writing the output: %s\n", input,
+                strerror(error));
+            goto end;
+        }
+
+        if (opts->mdflag) {
+            const char *dep_path = opts->dep_path;
+            if (!dep_path)
+                dep_path = default_path = replace_suffix(input, ".d");
+            if (write_deps(pp, opts, input, dep_path, out, err) < 0)
+                goto end;
+        }
+    }
+
+    if (opts->hflag)
+        pp_print_includes(pp, err, TOP_HEADERS);
+    if (opts->stats)
+        pp_print_stats(pp, err);
+    if (opts->stats && opts->memo_budget)
+        pp_print_memo(pp, err, TOP_MEMO_MACROS);
+    if (opts->profile)
+        pp_print_profile(pp, err, opts->profile_json);
+    result = 0;
+end:
+    free(default_path);
+    pp_free(pp);
+    return result;
+}
+
+// Translation unit of a parallel run (-j)
+typedef struct {
+    const char *input;
+    FILE *out, *err;  // Output and diagnostics, emitted in input order
+    int result;
+    _Bool done;
+} Unit;
+
+// Work shared by the threads of a parallel run
+typedef struct {
+    const Options *opts;
+    Unit *units;
+    size_t nunits;
+    size_t next;           // Next unit to take
+    pthread_mutex_t lock;
+    pthread_cond_t done;   // Signaled when a unit is done
+} Pool;
+
+static void *pool_worker(void *arg)
+{
+    Pool *pool = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t i = pool->next;
+        if (i < pool->nunits)
+            ++pool->next;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->nunits)
+            return NULL;
+
+        Unit *unit = pool->units + i;
+        unit->result = run_unit(pool->opts, unit->input, unit->out, unit->err);
+
+        pthread_mutex_lock(&pool->lock);
+        unit->done = 1;
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Copy a temporary file to the end of another file, then close it
+static void emit_tmpfile(FILE *tmp, FILE *fp)
+{
+    char buf[65536];
+    size_t n;
+
+    fflush(tmp);
+    rewind(tmp);
+    while ((n = fread(buf, 1, sizeof buf, tmp)))
+        fwrite(buf, 1, n, fp);
+    fclose(tmp);
+}
+
+// Process the translation units on a pool of threads, emitting their output
+// as soon as they and all the ones before them are done
+static int run_parallel(const Options *opts, char *inputs[], size_t ninputs,
+                        size_t jobs, FILE *out, FILE *err)
+{
+    Pool pool = {
+        .opts = opts,
+        .units = calloc(ninputs, sizeof *pool.units),
+        .nunits = ninputs,
+    };
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.done, NULL);
+
+    int result = 0;
+    for (size_t i = 0; i < ninputs; ++i) {
+        pool.units[i].input = inputs[i];
+        pool.units[i].out = tmpfile();
+        pool.units[i].err = tmpfile();
+        if (!pool.units[i].out || !pool.units[i].err) {
+            fprintf(err, "tmpfile: %s\n", strerror(errno));
+            result = 1;
+        }
+    }
+    if (result) {
+        for (size_t i = 0; i < ninputs; ++i) {
+            if (pool.units[i].out)
+                fclose(pool.units[i].out);
+            if (pool.units[i].err)
+                fclose(pool.units[i].err);
+        }
+        goto end;
+    }
+
+    // With fewer threads than asked for, or none, this one does the work
+    if (jobs > ninputs)
+        jobs = ninputs;
+    pthread_t *threads = calloc(jobs, sizeof *threads);
+    size_t started = 0;
+    while (started < jobs
+            && !pthread_create(threads + started, NULL, pool_worker, &pool))
+        ++started;
+    if (!started)
+        pool_worker(&pool);
+
+    for (size_t i = 0; i < ninputs; ++i) {
+        Unit *unit = pool.units + i;
+        pthread_mutex_lock(&pool.lock);
+        while (!unit->done)
+            pthread_cond_wait(&pool.done, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        emit_tmpfile(unit->out, out);
+        fflush(out);
+        emit_tmpfile(unit->err, err);
+        result |= unit->result;
+    }
+
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
+end:
+    pthread_cond_destroy(&pool.done);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.units);
+    return result;
+}
 
+enum {
+    OPT_M = 256,  // -M: only write dependencies
+    OPT_MM,       // -MM: only write dependencies, without system headers
+    OPT_MD,       // -MD: write dependencies next to the output
+    OPT_MMD,      // -MMD: same, without system headers
+    OPT_MF,       // -MF FILE: write dependencies to FILE
+    OPT_MT,       // -MT TARGET: target of the dependency rule
+    OPT_STATS,    // -fpp-stats: print pre-processor statistics
+    OPT_CACHE,    // -fpp-cache=MIB: size limit of the file cache
+    OPT_MEMO,     // -fpp-memo=MIB: memoize macro invocations, up to MIB
+    OPT_PROFILE,  // -fpp-profile[=json]: print the macro profile
+    OPT_PIPELINE, // -fpp-pipeline: pre-process on a thread of its own
+};
+
+static const struct option long_opts[] = {
+    { "M",   no_argument,       NULL, OPT_M   },
+    { "MM",  no_argument,       NULL, OPT_MM  },
+    { "MD",  no_argument,       NULL, OPT_MD  },
+    { "MMD", no_argument,       NULL, OPT_MMD },
+    { "MF",  required_argument, NULL, OPT_MF  },
+    { "MT",  required_argument, NULL, OPT_MT  },
+    { "fpp-stats", no_argument, NULL, OPT_STATS },
+    { "fpp-cache", required_argument, NULL, OPT_CACHE },
+    { "fpp-memo", required_argument, NULL, OPT_MEMO },
+    { "fpp-profile", optional_argument, NULL, OPT_PROFILE },
+    { "fpp-pipeline", no_argument, NULL, OPT_PIPELINE },
+    { NULL,  0,                 NULL, 0       },
+};
+
+// getopt keeps its state in globals, command lines run by the server at the
+// same time are parsed one at a time
+static pthread_mutex_t getopt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Parse the options of a command line, returns the index of the first input
+// or -1 if the command line is invalid
+static int parse_options(Options *opts, long *jobs, long *cache_budget,
+                         int argc, char *argv[])
+{
+    long memo_budget;
     int opt;
-    _Bool eflag = 0;
+    char *end;
 
-    while ((opt = getopt(argc, argv, "I:Eh")) != -1)
+    // Start over for each command line, the usage message covers errors
+    optind = 0;
+    opterr = 0;
+
+    // NOTE: long options start with a single dash like they do for cc
+    while ((opt = getopt_long_only(argc, argv, "I:EHj:h", long_opts, NULL)) != -1)
         switch (opt) {
         case 'I':
-            pp_add_search_dir(pp, optarg);
+            opts->search_dirs[opts->nsearch_dirs++] = optarg;
             break;
         case 'E':
-            eflag = 1;
+            opts->eflag = 1;
+            break;
+        case 'H':
+            opts->hflag = 1;
+            break;
+        case 'j':
+            *jobs = strtol(optarg, &end, 10);
+            if (*end || *jobs < 1)
+                return -1;
+            break;
+        case OPT_M:
+        case OPT_MM:
+            opts->mflag = 1;
+            opts->dep_system = opt == OPT_M;
+            break;
+        case OPT_MD:
+        case OPT_MMD:
+            opts->mdflag = 1;
+            opts->dep_system = opt == OPT_MD;
+            break;
+        case OPT_MF:
+            opts->dep_path = optarg;
+            break;
+        case OPT_MT:
+            opts->dep_target = optarg;
+            break;
+        case OPT_STATS:
+            opts->stats = 1;
+            break;
+        case OPT_CACHE:
+            *cache_budget = strtol(optarg, &end, 10);
+            if (*end || *cache_budget < 0)
+                return -1;
+            break;
+        case OPT_MEMO:
+            memo_budget = strtol(optarg, &end, 10);
+            if (*end || memo_budget < 0)
+                return -1;
+            opts->memo_budget = (size_t) memo_budget << 20;
+            break;
+        case OPT_PROFILE:
+            if (optarg && strcmp(optarg, "json"))
+                return -1;
+            opts->profile = 1;
+            opts->profile_json = optarg != NULL;
+            break;
+        case OPT_PIPELINE:
+            opts->pipeline = 1;
             break;
         case 'h':
         default:
-            goto print_usage;
+            return -1;
         }
 
-    if (optind >= argc) {
-print_usage:
-        fprintf(stderr, "Usage: %s [-I IDIR] [-h] FILE\n", argv[0]);
-        goto err;
+    return optind;
+}
+
+// Value of a variable of the environment envp, or NULL
+static const char *env_get(char *envp[], const char *name)
+{
+    size_t len = strlen(name);
+    for (; *envp; ++envp)
+        if (!strncmp(*envp, name, len) && (*envp)[len] == '=')
+            return *envp + len + 1;
+    return NULL;
+}
+
+// Add the directories of a colon separated list from the environment, an
+// empty one being the working directory
+static void add_env_dirs(Options *opts, const char *list, _Bool system)
+{
+    if (!list || !*list)
+        return;
+    for (const char *dir = list; ; ) {
+        size_t len = strcspn(dir, ":");
+        opts->env_dirs = realloc(opts->env_dirs,
+            (opts->nenv_dirs + 1) * sizeof *opts->env_dirs);
+        opts->env_dirs[opts->nenv_dirs++] = (EnvDir) {
+            len ? strndup(dir, len) : strdup("."), system
+        };
+        if (!dir[len])
+            break;
+        dir += len + 1;
     }
+}
+
+// Run a command line in the environment envp, writing to out and err instead
+// of stdout and stderr and with relative paths from the directory open at
+// dirfd
+static int run_command(int dirfd, char *envp[], int argc, char *argv[],
+                       FILE *out, FILE *err)
+{
+    Options opts = {
+        .dirfd = dirfd,
+        .search_dirs = calloc(argc, sizeof *opts.search_dirs),
+    };
+    long jobs = 1, cache_budget = -1;
+    int result = 1;
+
+    pthread_mutex_lock(&getopt_lock);
+    int first = parse_options(&opts, &jobs, &cache_budget, argc, argv);
+    pthread_mutex_unlock(&getopt_lock);
 
-    if (pp_push_file(pp, argv[optind]) < 0) {
-        perror(argv[optind]);
+    // Every input would write the same -MF file
+    if (first < 0 || first >= argc || (argc - first > 1 && opts.dep_path)) {
+        fprintf(err, "Usage: %s [-I IDIR] [-E] [-M|-MM|-MD|-MMD] "
+                     "[-MF FILE] [-MT TARGET] [-H] [-fpp-stats] "
+                     "[-fpp-cache=MIB] [-fpp-memo=MIB] [-fpp-profile[=json]]\n"
+                     "       [-fpp-pipeline] [-j N] [-h] FILE...\n"
+                     "       %s --server SOCKET [-fpp-cache=MIB]\n"
+                     "       %s --client SOCKET [OPTION]... FILE...\n",
+                     argv[0], argv[0], argv[0]);
         goto err;
     }
 
-    if (eflag)
-        do_preprocess(pp);
-    else
-        do_compile(pp);
+    add_env_dirs(&opts, env_get(envp, "CPATH"), 0);
+    add_env_dirs(&opts, env_get(envp, "C_INCLUDE_PATH"), 1);
+
+    // Headers are shared by the inputs, and re-read for every inclusion
+    if (!serving)
+        pp_cache_enable((size_t) (cache_budget < 0 ? CACHE_BUDGET
+                                                   : cache_budget) << 20);
+    else if (cache_budget >= 0)
+        fprintf(err, "Warning: -fpp-cache is set when the server starts\n");
+
+    if (jobs > 1 && argc - first > 1) {
+        result = run_parallel(&opts, argv + first, argc - first, jobs,
+            out, err);
+    } else {
+        result = 0;
+        for (int i = first; i < argc; ++i)
+            result |= run_unit(&opts, argv[i], out, err);
+    }
+
+    if (opts.stats) {
+        size_t hits, misses, bytes;
+        pp_cache_stats(&hits, &misses, &bytes);
+        fprintf(err, "File cache: %zu hits, %zu misses, %zu bytes\n",
+            hits, misses, bytes);
+    }
 
-    int result = 0;
 err:
-    result = 1;
-    pp_free(pp);
+    free(opts.search_dirs);
+    for (size_t i = 0; i < opts.nenv_dirs; ++i)
+        free(opts.env_dirs[i].path);
+    free(opts.env_dirs);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    // The server keeps the file cache across command lines
+    if (argc > 1 && !strcmp(argv[1], "--server")) {
+        long cache_budget = CACHE_BUDGET;
+        char *end;
+        if (argc == 4 && !strncmp(argv[3], "-fpp-cache=", 11)) {
+            cache_budget = strtol(argv[3] + 11, &end, 10);
+            if (*end || argv[3][11] == 0 || cache_budget < 0)
+                goto print_usage;
+        } else if (argc != 3) {
+            goto print_usage;
+        }
+        pp_cache_enable((size_t) cache_budget << 20);
+        serving = 1;
+        return server_run(argv[2], run_command);
+    }
+    if (argc > 1 && !strcmp(argv[1], "--client")) {
+        if (argc < 3)
+            goto print_usage;
+        // The server sees the command line without the --client part
+        const char *path = argv[2];
+        argv[2] = argv[0];
+        return client_run(path, argc - 2, argv + 2);
+    }
+
+    int result = run_command(AT_FDCWD, environ, argc, argv, stdout,
+        stderr);
+    pp_cache_free();
     return result;
+
+print_usage:
+    fprintf(stderr, "Usage: %s --server SOCKET [-fpp-cache=MIB]\n"
+                    "       %s --client SOCKET [OPTION]... FILE...\n",
+                    argv[0], argv[0]);
+    return 1;
 }
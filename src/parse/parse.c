@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <vec.h>
+#include <arena.h>
 #include <lex/token.h>
 #include <pp/pp.h>
 #include <target.h>
@@ -16,8 +17,11 @@
 #include "parse.h"
 
 struct ParseCtx {
-    // Pre-processor context
+    // Pre-processor context, or the pipe tokens are read from instead
     PpContext *pp;
+    PpPipe *pipe;
+    // Nodes live as long as the pre-processor context (or the pipe)
+    Arena *arena;
     // Current token
     Token *cur;
 };
@@ -30,10 +34,23 @@ ParseCtx *parse_create(PpContext *pp)
 
     ctx = calloc(1, sizeof *ctx);
     ctx->pp = pp;
+    ctx->arena = pp_arena(pp);
     ctx->cur = pp_next(pp);
     return ctx;
 }
 
+// Create a parser context, reading tokens from a pipe
+ParseCtx *parse_create_pipe(PpPipe *pipe)
+{
+    ParseCtx *ctx;
+
+    ctx = calloc(1, sizeof *ctx);
+    ctx->pipe = pipe;
+    ctx->arena = pp_pipe_arena(pipe);
+    ctx->cur = pp_pipe_next(pipe);
+    return ctx;
+}
+
 // Free a parser context
 void parse_free(ParseCtx *ctx)
 {
@@ -49,7 +66,7 @@ static Token *parse_cur(ParseCtx *ctx)
 // Advance to next token
 static void parse_advance(ParseCtx *ctx)
 {
-    ctx->cur = pp_next(ctx->pp);
+    ctx->cur = ctx->pipe ? pp_pipe_next(ctx->pipe) : pp_next(ctx->pp);
 }
 
 // Like advance but also free
@@ -64,6 +81,8 @@ static void parse_eat(ParseCtx *ctx)
 
 static void parse_err(ParseCtx *ctx, const char *msg)
 {
+    if (ctx->pipe)
+        pp_pipe_err(ctx->pipe, "%s", msg);
     pp_err(ctx->pp, msg);
 }
 
@@ -81,18 +100,18 @@ static _Bool parse_match(ParseCtx *ctx, TokenType type)
     return 0;
 }
 
-static Node *create_const(t_umax value)
+static Node *create_const(ParseCtx *ctx, t_umax value)
 {
     Node   *node;
 
-    node = calloc(1, sizeof *node);
+    node = arena_alloc(ctx->arena, sizeof *node);
     node->type = ND_CONST;
     node->value = value;
     return node;
 }
 
 // Convert a preprocessing number to an integer constant
-static Node *convert_int_const(Token *pp_num)
+static Node *convert_int_const(ParseCtx *ctx, Token *pp_num)
 {
     char   *cur;
     t_umax value;
@@ -145,7 +164,7 @@ static Node *convert_int_const(Token *pp_num)
     }
     end_value:
 
-    return create_const(value);
+    return create_const(ctx, value);
 
 // err:
 //     parse_err(ctx, "Invalid character in integer constant");
@@ -170,29 +189,30 @@ static Node *convert_char_const(ParseCtx *ctx, Token *char_const)
     } while (*++cur);
 
     // Create node
-    node = calloc(1, sizeof *node);
+    node = arena_alloc(ctx->arena, sizeof *node);
     node->type = ND_CONST;
     node->value = value;
     return node;
 }
 
 // Create a node with one child
-static Node *create_unary(NodeType type, Node *child1)
+static Node *create_unary(ParseCtx *ctx, NodeType type, Node *child1)
 {
     Node *node;
 
-    node = calloc(1, sizeof *node);
+    node = arena_alloc(ctx->arena, sizeof *node);
     node->type = type;
     node->child1 = child1;
     return node;
 }
 
 // Create a node with two children
-static Node *create_binary(NodeType type, Node *child1, Node *child2)
+static Node *create_binary(ParseCtx *ctx, NodeType type, Node *child1,
+                           Node *child2)
 {
     Node *node;
 
-    node = calloc(1, sizeof *node);
+    node = arena_alloc(ctx->arena, sizeof *node);
     node->type = type;
     node->child1 = child1;
     node->child2 = child2;
@@ -200,11 +220,12 @@ static Node *create_binary(NodeType type, Node *child1, Node *child2)
 }
 
 // Create a node with three children
-static Node *create_trinary(NodeType type, Node *child1, Node *child2, Node *child3)
+static Node *create_trinary(ParseCtx *ctx, NodeType type, Node *child1,
+                            Node *child2, Node *child3)
 {
     Node *node;
 
-    node = calloc(1, sizeof *node);
+    node = arena_alloc(ctx->arena, sizeof *node);
     node->type = type;
     node->child1 = child1;
     node->child2 = child2;
@@ -232,7 +253,7 @@ Node *p_primary(ParseCtx *ctx)
 
     switch (token->type) {
     case TK_PP_NUMBER:
-        node = convert_int_const(token);
+        node = convert_int_const(ctx, token);
         parse_eat(ctx);
         break;
     case TK_CHAR_CONST:
@@ -264,12 +285,12 @@ Node *p_postfix(ParseCtx *ctx)
 
     for (;;) {
         if (parse_match(ctx, TK_PLUS_PLUS)) {
-            node = create_unary(ND_POST_INC, node);
+            node = create_unary(ctx, ND_POST_INC, node);
             continue;
         }
 
         if (parse_match(ctx, TK_MINUS_MINUS)) {
-            node = create_unary(ND_POST_DEC, node);
+            node = create_unary(ctx, ND_POST_DEC, node);
             continue;
         }
 
@@ -280,21 +301,21 @@ Node *p_postfix(ParseCtx *ctx)
 Node *p_unary(ParseCtx *ctx)
 {
     if (parse_match(ctx, TK_PLUS_PLUS))
-        return create_unary(ND_PRE_INC, p_unary(ctx));
+        return create_unary(ctx, ND_PRE_INC, p_unary(ctx));
     if (parse_match(ctx, TK_MINUS_MINUS))
-        return create_unary(ND_PRE_DEC, p_unary(ctx));
+        return create_unary(ctx, ND_PRE_DEC, p_unary(ctx));
     if (parse_match(ctx, TK_AMPERSAND))
-        return create_unary(ND_REF, p_unary(ctx));
+        return create_unary(ctx, ND_REF, p_unary(ctx));
     if (parse_match(ctx, TK_STAR))
-        return create_unary(ND_DEREF, p_unary(ctx));
+        return create_unary(ctx, ND_DEREF, p_unary(ctx));
     if (parse_match(ctx, TK_PLUS)) // NOTE: we don't reflext unary + in the AST
         return p_unary(ctx);
     if (parse_match(ctx, TK_MINUS))
-        return create_unary(ND_MINUS, p_unary(ctx));
+        return create_unary(ctx, ND_MINUS, p_unary(ctx));
     if (parse_match(ctx, TK_TILDE))
-        return create_unary(ND_BIT_INV, p_unary(ctx));
+        return create_unary(ctx, ND_BIT_INV, p_unary(ctx));
     if (parse_match(ctx, TK_EXCL_MARK))
-        return create_unary(ND_NOT, p_unary(ctx));
+        return create_unary(ctx, ND_NOT, p_unary(ctx));
     return p_postfix(ctx);
 }
 static int peek_bop(ParseCtx *ctx)
@@ -372,7 +393,7 @@ Node *p_binary(ParseCtx *ctx, Node *lhs, int min_precedence)
                 break;
             rhs = p_binary(ctx, rhs, precedences[op_next]);
         }
-        lhs = create_binary(op, lhs, rhs);
+        lhs = create_binary(ctx, op, lhs, rhs);
     }
 }
 
@@ -390,7 +411,7 @@ Node *p_cond(ParseCtx *ctx)
     if (!parse_match(ctx, TK_COLON))
         parse_err(ctx, "Missing : from trinary conditional");
 
-    return create_trinary(ND_COND, n1, n2, p_cond(ctx));
+    return create_trinary(ctx, ND_COND, n1, n2, p_cond(ctx));
 }
 
 static int peek_aop(ParseCtx *ctx)
@@ -430,7 +451,7 @@ Node *p_assign(ParseCtx *ctx)
         return node;
     parse_eat(ctx);
 
-    return create_binary(aop, node, p_assign(ctx));
+    return create_binary(ctx, aop, node, p_assign(ctx));
 }
 
 Node *p_expression(ParseCtx *ctx)
@@ -441,7 +462,7 @@ Node *p_expression(ParseCtx *ctx)
     if (!parse_match(ctx, TK_COMMA))
         return node;
 
-    return create_binary(ND_COMMA, node, p_expression(ctx));
+    return create_binary(ctx, ND_COMMA, node, p_expression(ctx));
 }
 
 // Declaration parser
@@ -73,6 +73,9 @@ typedef struct ParseCtx ParseCtx;
 // Create a parser context
 ParseCtx *parse_create(PpContext *pp);
 
+// Create a parser context reading from a pre-processor pipe
+ParseCtx *parse_create_pipe(PpPipe *pipe);
+
 // Close a parser context
 void parse_free(ParseCtx *parse_ctx);
 
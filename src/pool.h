@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdlib.h>
+#include <string.h>
+
+// Size of the chunks objects are carved out of
+#ifndef POOL_CHUNK_SIZE
+#define POOL_CHUNK_SIZE 16384
+#endif
+
+// Alignment of the chunks
+#define POOL_ALIGN 64
+
+// Byte written over released objects (make POOL_POISON=1)
+#define POOL_POISON_BYTE 0xa5
+
+//
+// Generate type specific definitions of an object pool
+//
+// Objects are carved out of cache line aligned chunks, released ones are
+// kept on a free list threaded through their own storage, and reused first.
+// Chunks are only freed with the pool, resetting it releases every object
+// at once. With POOL_POISON defined, released objects are overwritten, so
+// uses after release show up.
+//
+#define POOL_GEN(type, stru_name, fn_pre)                                      \
+                                                                               \
+typedef union stru_name##Slot stru_name##Slot;                                 \
+union stru_name##Slot {                                                        \
+    type            obj;                                                       \
+    stru_name##Slot *next; /* Next free slot */                                \
+};                                                                             \
+                                                                               \
+typedef struct stru_name##Chunk stru_name##Chunk;                              \
+struct stru_name##Chunk {                                                      \
+    stru_name##Chunk *next;                                                    \
+    stru_name##Slot  slots[];                                                  \
+};                                                                             \
+                                                                               \
+typedef struct {                                                               \
+    stru_name##Chunk *chunks; /* First chunk */                                \
+    stru_name##Chunk *cur;    /* Chunk objects are carved out of */            \
+    size_t           used;    /* Slots carved out of cur */                    \
+    stru_name##Slot  *free;   /* Released slots */                             \
+} stru_name;                                                                   \
+                                                                               \
+/* Number of slots in a chunk */                                               \
+static inline size_t fn_pre##_chunk_slots(void)                                \
+{                                                                              \
+    size_t n = (POOL_CHUNK_SIZE - sizeof(stru_name##Chunk))                    \
+        / sizeof(stru_name##Slot);                                             \
+    return n ? n : 1;                                                          \
+}                                                                              \
+                                                                               \
+static inline void fn_pre##_init(stru_name *self)                              \
+{                                                                              \
+    self->chunks = NULL;                                                       \
+    self->cur = NULL;                                                          \
+    self->used = 0;                                                            \
+    self->free = NULL;                                                         \
+}                                                                              \
+                                                                               \
+static inline void fn_pre##_free(stru_name *self)                              \
+{                                                                              \
+    for (stru_name##Chunk *chunk = self->chunks; chunk; ) {                    \
+        stru_name##Chunk *next = chunk->next;                                  \
+        free(chunk);                                                           \
+        chunk = next;                                                          \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+/* Take the next chunk, reusing the ones kept by a reset first */              \
+static inline void fn_pre##_grow(stru_name *self)                              \
+{                                                                              \
+    if (!self->cur || !self->cur->next) {                                      \
+        size_t size = sizeof(stru_name##Chunk)                                 \
+            + fn_pre##_chunk_slots() * sizeof(stru_name##Slot);                \
+        stru_name##Chunk *chunk = aligned_alloc(POOL_ALIGN,                    \
+            (size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN);                \
+        chunk->next = NULL;                                                    \
+        if (self->cur)                                                         \
+            self->cur->next = chunk;                                           \
+        else                                                                   \
+            self->chunks = chunk;                                              \
+        self->cur = chunk;                                                     \
+    } else {                                                                   \
+        self->cur = self->cur->next;                                           \
+    }                                                                          \
+    self->used = 0;                                                            \
+}                                                                              \
+                                                                               \
+/* Allocate a zeroed object */                                                 \
+static inline type *fn_pre##_alloc(stru_name *self)                            \
+{                                                                              \
+    stru_name##Slot *slot = self->free;                                        \
+    if (slot) {                                                                \
+        POOL_ASAN_UNPOISON(slot, sizeof *slot);                                \
+        self->free = slot->next;                                               \
+    } else {                                                                   \
+        if (!self->cur || self->used == fn_pre##_chunk_slots())                \
+            fn_pre##_grow(self);                                               \
+        slot = self->cur->slots + self->used++;                                \
+        POOL_ASAN_UNPOISON(slot, sizeof *slot);                                \
+    }                                                                          \
+    memset(slot, 0, sizeof *slot);                                             \
+    return &slot->obj;                                                         \
+}                                                                              \
+                                                                               \
+static inline void fn_pre##_release(stru_name *self, type *obj)                \
+{                                                                              \
+    stru_name##Slot *slot = (stru_name##Slot *) obj;                           \
+    POOL_FILL(slot, sizeof *slot);                                             \
+    slot->next = self->free;                                                   \
+    self->free = slot;                                                         \
+    POOL_ASAN_POISON(slot, sizeof *slot);                                      \
+}                                                                              \
+                                                                               \
+/* Release every object, keeping the chunks for the next ones */               \
+static inline void fn_pre##_reset(stru_name *self)                             \
+{                                                                              \
+    for (stru_name##Chunk *chunk = self->chunks; chunk; chunk = chunk->next) { \
+        size_t size = (chunk == self->cur ? self->used                         \
+            : fn_pre##_chunk_slots()) * sizeof(stru_name##Slot);               \
+        POOL_ASAN_UNPOISON(chunk->slots, size);                                \
+        POOL_FILL(chunk->slots, size);                                         \
+        POOL_ASAN_POISON(chunk->slots, size);                                  \
+        if (chunk == self->cur)                                                \
+            break;                                                             \
+    }                                                                          \
+    self->cur = self->chunks;                                                  \
+    self->used = 0;                                                            \
+    self->free = NULL;                                                         \
+}
+
+#ifdef POOL_POISON
+#define POOL_FILL(ptr, size) memset(ptr, POOL_POISON_BYTE, size)
+#else
+#define POOL_FILL(ptr, size) ((void) (size))
+#endif
+
+// Released objects are off limits for AddressSanitizer too
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#define POOL_ASAN_POISON(ptr, size) ASAN_POISON_MEMORY_REGION(ptr, size)
+#define POOL_ASAN_UNPOISON(ptr, size) ASAN_UNPOISON_MEMORY_REGION(ptr, size)
+#else
+#define POOL_ASAN_POISON(ptr, size) ((void) (size))
+#define POOL_ASAN_UNPOISON(ptr, size) ((void) (size))
+#endif
+
+#endif
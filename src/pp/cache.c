@@ -0,0 +1,358 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//
+// Pre-processor: process wide cache of file contents
+//
+// Every context of the process reads headers through here. Lookups don't
+// take any lock, adding entries does. Entries are keyed by the file's
+// identity (device and inode), and checked against its size and modification
+// time: a new version of a file replaces the entry of the old one, which is
+// retired, and only freed once no frame reads it and no lookup that could
+// have found it is in progress.
+//
+// Once the budget is reached, entries no frame reads are retired to make room
+// for new ones, like a clock: a hand sweeps the buckets, giving entries used
+// since it last went by another turn.
+//
+// Alongside the contents, each entry keeps an index of the conditional blocks
+// skipped in the file: where skipping started, and the position of the
+// directive that ended it. Skipping only depends on the contents, so it's
+// the same for every context.
+//
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vec.h>
+#include <hash.h>
+#include <pool.h>
+#include <arena.h>
+#include <lex/token.h>
+#include <lex/lex.h>
+#include "pp.h"
+#include "def.h"
+
+// Number of hash buckets
+#define CACHE_BUCKETS 4096
+
+// Number of hash buckets of the skipped block index of a file
+#define SKIP_BUCKETS 64
+
+// Conditional block skipped in a file
+typedef struct CondSkip CondSkip;
+struct CondSkip {
+    size_t          start;     // Offset skipping started at
+    _Bool           else_elif; // Could it stop at #else or #elif?
+    LexPos          end;       // Position after the directive ending it
+    Cond            cond;      // Which directive that was
+    CondSkip        *next;     // Next entry in the same bucket
+};
+
+struct CachedFile {
+    dev_t           dev;     // Identity of the file
+    ino_t           ino;
+    off_t           size;    // Version of the file
+    struct timespec mtime;
+    char            *data;   // Contents of the file (NUL terminated)
+    CondSkip        **skips; // Skipped block index (allocated on first use)
+    size_t          refs;    // Frames reading it
+    _Bool           used;    // Used since the clock hand last went by?
+    CachedFile      *next;   // Next entry in the same bucket
+    CachedFile      *next_retired;
+};
+
+static struct {
+    size_t          budget;  // Most bytes of contents kept
+    size_t          bytes;   // Bytes of contents kept
+    size_t          hits;    // Opens served from the cache
+    size_t          misses;  // Opens that had to read the file
+    size_t          lookups; // Lookups in progress
+    // Taken to add and retire entries, and to free retired ones
+    pthread_mutex_t lock;
+    CachedFile      *retired;
+    size_t          hand;    // Next bucket to sweep for room
+    CachedFile      *buckets[CACHE_BUCKETS];
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void pp_cache_enable(size_t budget)
+{
+    __atomic_store_n(&cache.budget, budget, __ATOMIC_RELAXED);
+}
+
+void pp_cache_stats(size_t *hits, size_t *misses, size_t *bytes)
+{
+    *hits = __atomic_load_n(&cache.hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&cache.misses, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&cache.bytes, __ATOMIC_RELAXED);
+}
+
+static void free_file(CachedFile *file)
+{
+    if (file->skips) {
+        for (size_t j = 0; j < SKIP_BUCKETS; ++j)
+            for (CondSkip *skip = file->skips[j]; skip; ) {
+                CondSkip *next = skip->next;
+                free(skip);
+                skip = next;
+            }
+        free(file->skips);
+    }
+    free(file->data);
+    free(file);
+}
+
+void pp_cache_free(void)
+{
+    for (size_t i = 0; i < CACHE_BUCKETS; ++i)
+        for (CachedFile *file = cache.buckets[i]; file; ) {
+            CachedFile *next = file->next;
+            free_file(file);
+            file = next;
+        }
+    for (CachedFile *file = cache.retired; file; ) {
+        CachedFile *next = file->next_retired;
+        free_file(file);
+        file = next;
+    }
+    pthread_mutex_destroy(&cache.lock);
+    memset(&cache, 0, sizeof cache);
+    pthread_mutex_init(&cache.lock, NULL);
+}
+
+// Free the retired entries no frame reads, unless a lookup is in progress:
+// it may have found one before it was retired, and be about to read it
+static void free_retired(void)
+{
+    pthread_mutex_lock(&cache.lock);
+    if (!__atomic_load_n(&cache.lookups, __ATOMIC_SEQ_CST)) {
+        for (CachedFile **prev = &cache.retired; *prev; ) {
+            CachedFile *file = *prev;
+            if (__atomic_load_n(&file->refs, __ATOMIC_SEQ_CST)) {
+                prev = &file->next_retired;
+                continue;
+            }
+            __atomic_store_n(prev, file->next_retired, __ATOMIC_RELAXED);
+            free_file(file);
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void cache_close(CachedFile *file)
+{
+    __atomic_sub_fetch(&file->refs, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cache.retired, __ATOMIC_RELAXED))
+        free_retired();
+}
+
+static CachedFile **find_bucket(struct stat *st)
+{
+    return cache.buckets + (st->st_dev * 31 + st->st_ino) % CACHE_BUCKETS;
+}
+
+static _Bool same_file(CachedFile *file, struct stat *st)
+{
+    return file->dev == st->st_dev && file->ino == st->st_ino
+        && file->size == st->st_size
+        && file->mtime.tv_sec == st->st_mtim.tv_sec
+        && file->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static CachedFile *find_file(CachedFile *file, struct stat *st)
+{
+    for (; file; file = __atomic_load_n(&file->next, __ATOMIC_SEQ_CST))
+        if (same_file(file, st))
+            return file;
+    return NULL;
+}
+
+// Read the whole file, returns NULL on failure
+static char *read_file(int fd, size_t size)
+{
+    char *data = malloc(size + 1);
+    size_t len = 0;
+    while (len < size) {
+        ssize_t n = read(fd, data + len, size - len);
+        if (n <= 0) {
+            free(data);
+            return NULL;
+        }
+        len += n;
+    }
+    data[len] = 0;
+    return data;
+}
+
+// Unlink an entry from its bucket and retire it, under the lock: lookups
+// going through it still find their way to the rest of the bucket
+static void retire_file(CachedFile **prev)
+{
+    CachedFile *file = *prev;
+    __atomic_store_n(prev, file->next, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&cache.bytes, file->size, __ATOMIC_RELAXED);
+    file->next_retired = cache.retired;
+    __atomic_store_n(&cache.retired, file, __ATOMIC_RELAXED);
+}
+
+// Retire entries no frame reads until size more bytes fit in the budget,
+// under the lock, returns 0 if they don't
+static _Bool make_room(size_t size, size_t budget)
+{
+    // NOTE: the first turn of the hand may only clear the used marks
+    for (size_t n = 0; n < 2 * CACHE_BUCKETS && cache.bytes + size > budget;
+            ++n) {
+        CachedFile **prev = cache.buckets + cache.hand;
+        cache.hand = (cache.hand + 1) % CACHE_BUCKETS;
+        while (*prev && cache.bytes + size > budget) {
+            CachedFile *file = *prev;
+            if (__atomic_load_n(&file->refs, __ATOMIC_SEQ_CST)
+                    || __atomic_exchange_n(&file->used, 0, __ATOMIC_RELAXED))
+                prev = &file->next;
+            else
+                retire_file(prev);
+        }
+    }
+    return cache.bytes + size <= budget;
+}
+
+// Add the contents of a file, replacing older versions of it, returns the
+// entry that ended up in the cache (referenced by the caller) or NULL if it's
+// over budget or can't be read
+static CachedFile *add_file(int fd, struct stat *st)
+{
+    size_t size = st->st_size,
+           budget = __atomic_load_n(&cache.budget, __ATOMIC_RELAXED);
+    if (size > budget)
+        return NULL;
+
+    CachedFile *file = calloc(1, sizeof *file);
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->size = st->st_size;
+    file->mtime = st->st_mtim;
+    if (!(file->data = read_file(fd, size))) {
+        free(file);
+        return NULL;
+    }
+
+    // Publish the entry, unless another thread got there first
+    pthread_mutex_lock(&cache.lock);
+    CachedFile **bucket = find_bucket(st);
+    CachedFile *other = find_file(*bucket, st);
+    if (other) {
+        __atomic_add_fetch(&other->refs, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&cache.lock);
+        free_file(file);
+        return other;
+    }
+    // Retire older versions of the file
+    for (CachedFile **prev = bucket; *prev; )
+        if ((*prev)->dev == st->st_dev && (*prev)->ino == st->st_ino)
+            retire_file(prev);
+        else
+            prev = &(*prev)->next;
+    if (!make_room(size, budget)) {
+        pthread_mutex_unlock(&cache.lock);
+        free_file(file);
+        return NULL;
+    }
+    __atomic_add_fetch(&cache.bytes, size, __ATOMIC_RELAXED);
+    file->refs = 1;
+    file->used = 1;
+    file->next = *bucket;
+    __atomic_store_n(bucket, file, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&cache.lock);
+    return file;
+}
+
+LexCtx *cache_open_file(int dirfd, const char *path, CachedFile **cached)
+{
+    *cached = NULL;
+    int fd = openat(dirfd, path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (!__atomic_load_n(&cache.budget, __ATOMIC_RELAXED)
+            || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+        return lex_open_fd(path, fd);
+
+    // NOTE: the entry found is referenced before the lookup ends, retired
+    // entries aren't freed meanwhile
+    __atomic_add_fetch(&cache.lookups, 1, __ATOMIC_SEQ_CST);
+    CachedFile *file = find_file(
+        __atomic_load_n(find_bucket(&st), __ATOMIC_SEQ_CST), &st);
+    if (file) {
+        __atomic_add_fetch(&file->refs, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&file->used, __ATOMIC_RELAXED))
+            __atomic_store_n(&file->used, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&cache.hits, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&cache.misses, 1, __ATOMIC_RELAXED);
+        file = add_file(fd, &st);
+    }
+    __atomic_sub_fetch(&cache.lookups, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cache.retired, __ATOMIC_RELAXED))
+        free_retired();
+
+    // Files over the budget are read directly
+    if (!file) {
+        lseek(fd, 0, SEEK_SET);
+        return lex_open_fd(path, fd);
+    }
+    close(fd);
+    *cached = file;
+    return lex_open_string(path, file->data);
+}
+
+static CondSkip **find_skip_bucket(CondSkip **skips, size_t start)
+{
+    return skips + start % SKIP_BUCKETS;
+}
+
+_Bool cache_find_skip(CachedFile *file, size_t start, _Bool else_elif,
+                      LexPos *end, Cond *cond)
+{
+    CondSkip **skips = __atomic_load_n(&file->skips, __ATOMIC_ACQUIRE);
+    if (!skips)
+        return 0;
+    CondSkip *skip = __atomic_load_n(find_skip_bucket(skips, start),
+                                     __ATOMIC_ACQUIRE);
+    for (; skip; skip = skip->next)
+        if (skip->start == start && skip->else_elif == else_elif) {
+            *end = skip->end;
+            *cond = skip->cond;
+            return 1;
+        }
+    return 0;
+}
+
+void cache_add_skip(CachedFile *file, size_t start, _Bool else_elif,
+                    const LexPos *end, Cond cond)
+{
+    // Allocate the index, unless another thread got there first
+    CondSkip **skips = __atomic_load_n(&file->skips, __ATOMIC_ACQUIRE);
+    if (!skips) {
+        CondSkip **new = calloc(SKIP_BUCKETS, sizeof *new);
+        if (__atomic_compare_exchange_n(&file->skips, &skips, new, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            skips = new;
+        else
+            free(new);
+    }
+
+    // NOTE: two threads might add the same block, both entries are the same
+    CondSkip *skip = calloc(1, sizeof *skip);
+    skip->start = start;
+    skip->else_elif = else_elif;
+    skip->end = *end;
+    skip->cond = cond;
+    CondSkip **bucket = find_skip_bucket(skips, start);
+    skip->next = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(bucket, &skip->next, skip, 0,
+                __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        ;
+}
@@ -4,10 +4,14 @@
 // Pre-processor: core logic
 //
 
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <time.h>
 #include <vec.h>
+#include <hash.h>
+#include <pool.h>
+#include <arena.h>
 #include <lex/token.h>
 #include <lex/lex.h>
 #include "pp.h"
@@ -15,38 +19,35 @@
 
 static Frame *find_lexer_frame(PpContext *ctx)
 {
-    // Skip all sub-contexts (they never include lexer frames)
-    while (ctx->parent)
-        ctx = ctx->parent;
-    // Walk the stack of the first real context
-    Frame *file_frame = ctx->frames;
-    while (file_frame && file_frame->type != F_LEXER)
-        file_frame = file_frame->next;
     // A file frame should always exist, otherwise we abort
-    if (!file_frame)
+    if (!ctx->frames.n)
         abort();
-    return file_frame;
-}
-
-static struct tm *find_start_time(PpContext *ctx)
-{
-    // Only the topmost context has the start time
-    while (ctx->parent)
-        ctx = ctx->parent;
-    return ctx->start_time;
+    return frame_stack_top(&ctx->frames);
 }
 
 void __attribute__((noreturn)) pp_err(PpContext *ctx, const char *err, ...)
 {
     Frame *lex_frame = find_lexer_frame(ctx);
+    // The output before the error comes first
+    void *out = ctx->out;
+    ctx->out = NULL;
+    if (out)
+        out_flush_buffer(out);
     fflush(stdout);
-    fprintf(stderr, "Error: %s:%ld: ", lex_path(lex_frame->lex),
+    fprintf(ctx->err_fp, "Error: %s:%ld: ", lex_path(lex_frame->lex),
         lex_line(lex_frame->lex));
     va_list ap;
     va_start(ap, err);
-    vfprintf(stderr, err, ap);
+    vfprintf(ctx->err_fp, err, ap);
     va_end(ap);
-    fputc('\n', stderr);
+    fputc('\n', ctx->err_fp);
+    pp_fail(ctx);
+}
+
+void __attribute__((noreturn)) pp_fail(PpContext *ctx)
+{
+    if (ctx->err_handler)
+        ctx->err_handler(ctx->err_arg);
     exit(1);
 }
 
@@ -64,15 +65,15 @@ static void handle_date(PpContext *ctx)
 {
     char buf[12];
     // FIXME: %b is locale specific :/
-    strftime(buf, sizeof buf, "%b %d %Y", find_start_time(ctx));
-    token_list_add(pp_push_list_frame(ctx, NULL), create_string_lit(buf));
+    strftime(buf, sizeof buf, "%b %d %Y", ctx->start_time);
+    pp_unread(ctx, create_string_lit(buf));
 }
 
 static void handle_time(PpContext *ctx)
 {
     char buf[12];
-    strftime(buf, sizeof buf, "%H:%M:%S", find_start_time(ctx));
-    token_list_add(pp_push_list_frame(ctx, NULL), create_string_lit(buf));
+    strftime(buf, sizeof buf, "%H:%M:%S", ctx->start_time);
+    pp_unread(ctx, create_string_lit(buf));
 }
 
 static void handle_file(PpContext *ctx)
@@ -83,7 +84,7 @@ static void handle_file(PpContext *ctx)
     while ((next = strchr(prev, '/')))
         prev = next + 1;
     // Add filename string literal to tokens
-    token_list_add(pp_push_list_frame(ctx, NULL), create_string_lit(prev));
+    pp_unread(ctx, create_string_lit(prev));
 }
 
 static void handle_line(PpContext *ctx)
@@ -93,22 +94,17 @@ static void handle_line(PpContext *ctx)
     char buf[10];
     snprintf(buf, sizeof buf, "%ld", lex_line(lex_frame->lex));
     // Add pre-processing number token with the line number
-    token_list_add(pp_push_list_frame(ctx, NULL),
-        create_token(TK_PP_NUMBER, TOKEN_NOFLAGS, strdup(buf)));
+    pp_unread(ctx, create_token(TK_PP_NUMBER, TOKEN_NOFLAGS, strdup(buf)));
 }
 
 static void handle_vers(PpContext *ctx)
 {
-    TokenList *list = pp_push_list_frame(ctx, NULL);
-    token_list_add(list,
-        create_token(TK_PP_NUMBER, TOKEN_NOFLAGS, strdup("199901L")));
+    pp_unread(ctx, create_token(TK_PP_NUMBER, TOKEN_NOFLAGS, strdup("199901L")));
 }
 
 static void handle_one(PpContext *ctx)
 {
-    TokenList *list = pp_push_list_frame(ctx, NULL);
-    token_list_add(list,
-        create_token(TK_PP_NUMBER, TOKEN_NOFLAGS, strdup("1")));
+    pp_unread(ctx, create_token(TK_PP_NUMBER, TOKEN_NOFLAGS, strdup("1")));
 }
 
 //
@@ -149,116 +145,263 @@ Predef *find_predef(Token *identifier)
     return NULL;
 }
 
-static Frame *new_frame(PpContext *ctx)
+double wall_time(void)
 {
-    Frame *frame = calloc(1, sizeof *frame);
-    frame->next = ctx->frames;
-    ctx->frames = frame;
-    return frame;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-void pp_push_lex_frame(PpContext *ctx, LexCtx *lex)
+void pp_push_lex_frame(PpContext *ctx, LexCtx *lex, CachedFile *cached)
 {
-    Frame *frame = new_frame(ctx);
-    frame->type = F_LEXER;
+    Frame *frame = frame_stack_push(&ctx->frames);
+    // Slots below the pooled count have storage left from a previous frame
+    if (ctx->frames.n > ctx->frames_pooled) {
+        cond_list_init(&frame->conds);
+        ctx->frames_pooled = ctx->frames.n;
+    }
     frame->lex = lex;
-    cond_list_init(&frame->conds);
+    frame->system = 0;
+    frame->tokens = 0;
+    frame->macros = 0;
+    frame->dep = NULL;
+    frame->cached = cached;
+    if (ctx->report_includes) {
+        frame->include = ctx->includes.n;
+        include_list_add(&ctx->includes, (Include) {
+            .path = arena_strdup(&ctx->arena, lex_path(lex)),
+            .depth = ctx->frames.n - 1,
+            .start = wall_time(),
+            .time = -1,
+        });
+    }
+    PP_STAT(ctx, files);
+    PP_STAT_MAX(ctx, max_include, ctx->frames.n - 1);
+}
+
+const char *pp_add_dep(PpContext *ctx, const char *path, _Bool system)
+{
+    // Files are listed once, even if read more than once
+    ssize_t slot = dep_map_slot(&ctx->dep_paths, path);
+    if (slot >= 0) {
+        DepMapEntry *entry = ctx->dep_paths.arr + slot;
+        if (entry->value < ctx->deps.n
+                && ctx->deps.arr[entry->value].path == entry->key)
+            return entry->key;
+        // Dropped from the list by restoring a checkpoint, list it again
+        entry->value = ctx->deps.n;
+        dep_list_add(&ctx->deps, (Dep) { entry->key, system });
+        return entry->key;
+    }
+    dep_list_add(&ctx->deps,
+        (Dep) { arena_strdup(&ctx->arena, path), system });
+    dep_map_put(&ctx->dep_paths, ctx->deps.arr[ctx->deps.n - 1].path,
+        ctx->deps.n - 1);
+    return ctx->deps.arr[ctx->deps.n - 1].path;
 }
 
-TokenList *pp_push_list_frame(PpContext *ctx, Macro *source)
+// Finish the include report entry of a frame that reached its end
+static void end_include(PpContext *ctx, Frame *frame)
 {
-    Frame *frame = new_frame(ctx);
-    frame->type = F_LIST;
-    frame->source = source;
-    frame->i = 0;
+    if (!ctx->report_includes)
+        return;
+    Include *include = ctx->includes.arr + frame->include;
+    if (include->time < 0) {
+        include->time = wall_time() - include->start;
+        include->tokens = frame->tokens;
+        include->macros = frame->macros;
+    }
+}
 
-    token_list_init(&frame->list);
-    return &frame->list;
+// Path of a frame, kept as long as the context
+static const char *frame_path(PpContext *ctx, Frame *frame)
+{
+    if (frame->dep)
+        return frame->dep;
+    return arena_strdup(&ctx->arena, lex_path(frame->lex));
 }
 
-static void drop_frame(PpContext *ctx)
+void pp_enter_file(PpContext *ctx)
 {
-    Frame *frame = ctx->frames;
-    if (frame->type == F_LEXER) {
-        if (frame->conds.n)
-            pp_err(ctx, "Unterminated conditional inclusion");
-        // Free lexer context
-        lex_free(frame->lex);
-        // Free conditional inclusion stack
-        cond_list_free(&frame->conds);
-    } else {
-        // Re-enable macro when popping list frame
-        if (frame->source)
-            frame->source->enabled = 1;
-        // Free any remaining tokens
-        for (; frame->i < frame->list.n; ++frame->i)
-            free_token(frame->list.arr[frame->i]);
-        // Free list
-        token_list_free(&frame->list);
+    Frame *frame = frame_stack_top(&ctx->frames), *from = frame - 1;
+    file_event_list_add(&ctx->file_events, (FileEvent) {
+        .enter = 1,
+        .path = frame_path(ctx, frame),
+        .line = lex_line(frame->lex),
+        .from = frame_path(ctx, from),
+        // NOTE: the lexer is past the newline of the #include
+        .from_line = lex_line(from->lex) - 1,
+    });
+}
+
+void drop_frame(PpContext *ctx)
+{
+    Frame *frame = frame_stack_top(&ctx->frames);
+    end_include(ctx, frame);
+    // Free lexer context
+    lex_free(frame->lex);
+    if (frame->cached)
+        cache_close(frame->cached);
+    --ctx->frames.n;
+}
+
+void pp_unread(PpContext *ctx, Token *token)
+{
+    token_list_add(&ctx->pending, token);
+}
+
+void pp_flip_pending(PpContext *ctx, size_t start)
+{
+    Token **l = ctx->pending.arr + start, **r = ctx->pending.arr + ctx->pending.n;
+    while (l < r) {
+        Token *tmp = *l;
+        *l++ = *--r;
+        *r = tmp;
     }
-    ctx->frames = ctx->frames->next;
-    free(frame);
+}
+
+void pp_push_isolated(PpContext *ctx)
+{
+    token_list_add(&ctx->pending, NULL);
+    ++ctx->isolated;
+}
+
+void pp_pop_isolated(PpContext *ctx)
+{
+    // Free any tokens left from the isolated sequence
+    Token *token;
+    while ((token = token_list_pop(&ctx->pending)))
+        free_token(token);
+    --ctx->isolated;
+}
+
+static void free_frames(PpContext *ctx)
+{
+    // Pending tokens sit on top of the frame stack
+    for (size_t i = 0; i < ctx->pending.n; ++i)
+        if (ctx->pending.arr[i])
+            free_token(ctx->pending.arr[i]);
+    token_list_free(&ctx->pending);
+    while (ctx->frames.n)
+        drop_frame(ctx);
+    for (size_t i = 0; i < ctx->frames_pooled; ++i)
+        cond_list_free(&ctx->frames.arr[i].conds);
+    frame_stack_free(&ctx->frames);
 }
 
 Token *pp_read(PpContext *ctx)
 {
     Frame *frame;
-    Token *token = NULL;
+    Token *token;
+
+    // Profiled expansions end once reading goes below their tokens
+    while (ctx->prof_frames.n
+            && ctx->pending.n <= prof_stack_top(&ctx->prof_frames)->level)
+        prof_end(ctx);
+
+    // Pending tokens come before anything on the frame stack, reading stops
+    // at the end of an isolated sequence
+    while (ctx->pending.n) {
+        token = *token_list_top(&ctx->pending);
+        if (!token)
+            return NULL;
+        --ctx->pending.n;
+        // Reading past the end of an expansion being memoized
+        if (ctx->memo && token == ctx->memo->end) {
+            memo_end(ctx, 0);
+            continue;
+        }
+        return token;
+    }
 
 recurse:
-    frame = ctx->frames;
-    if (frame == NULL)
+    if (ctx->frames.n == 0)
         return NULL;
+    frame = frame_stack_top(&ctx->frames);
 
-    switch (frame->type) {
-    case F_LEXER:
-        token = lex_next(frame->lex);
-        // Drop frame if file has hit its end, and it isn't the bottom frame
-        if (token == NULL && frame->next != NULL) {
-            drop_frame(ctx);
-            goto recurse;
-        }
-        // Handle pre-processing directives when reading from the lexer
-        if (token && token->type == TK_HASH && token->flags.directive) {
-            free_token(token);
-            handle_directive(ctx);
-            goto recurse;
-        }
-        break;
-    case F_LIST:
-        // Drop frame if list reached its end
-        if (frame->i >= frame->list.n) {
+    token = lex_next(frame->lex);
+    if (token) {
+        ++frame->tokens;
+        PP_STAT(ctx, lexed);
+    }
+    // Drop frame if file has hit its end, and it isn't the bottom frame
+    if (token == NULL) {
+        if (frame->conds.n)
+            pp_err(ctx, "Unterminated conditional inclusion");
+        if (ctx->frames.n > 1) {
             drop_frame(ctx);
+            frame = frame_stack_top(&ctx->frames);
+            file_event_list_add(&ctx->file_events, (FileEvent) {
+                .path = frame_path(ctx, frame),
+                .line = lex_line(frame->lex),
+            });
             goto recurse;
         }
-        // Get token from the token list
-        token = frame->list.arr[frame->i++];
-        break;
+        end_include(ctx, frame);
+    }
+    // Handle pre-processing directives when reading from the lexer
+    if (token && token->type == TK_HASH && token->flags.directive) {
+        free_token(token);
+        handle_directive(ctx);
+        goto recurse;
     }
     return token;
 }
 
-Macro *new_macro(PpContext *ctx)
+Macro *new_macro(PpContext *ctx, Token *name)
 {
-    Macro *macro = calloc(1, sizeof *macro);
-    macro->next = ctx->macros;
-    ctx->macros = macro;
+    Macro *macro = macro_pool_alloc(&ctx->macro_pool);
+    macro->serial = ++ctx->macro_serial;
+    macro->name = name;
+    macro->ident = intern_name(ctx, name->data);
+    ++ctx->macro_gen;
+    if (ctx->incr)
+        macro_list_add(&ctx->incr->defined, macro);
+    Macro **slot = macro_map_find(&ctx->macros, macro->ident);
+    if (slot) {
+        macro->shadowed = *slot;
+        *slot = macro;
+    } else {
+        macro_map_put(&ctx->macros, macro->ident, macro);
+    }
     return macro;
 }
 
+Macro *lookup_macro(PpContext *ctx, const char *name)
+{
+    Macro **macro = macro_map_find(&ctx->macros, name);
+    return macro ? *macro : NULL;
+}
+
 Macro *find_macro(PpContext *ctx, Token *token)
 {
-    Macro *macro;
+    Macro *macro = lookup_macro(ctx, token->data);
 
-    for (macro = ctx->macros; macro; macro = macro->next) {
-        if (!strcmp(macro->name->data, token->data)) {
-            return macro;
-        }
+    // Results memoized depend on every lookup made for them
+    if (ctx->lookups)
+        macro_ref_list_add(ctx->lookups, (MacroRef) {
+            strdup(token->data), macro ? macro->serial : 0 });
+    return macro;
+}
+
+_Bool macro_refs_valid(PpContext *ctx, MacroRefList *refs)
+{
+    for (size_t i = 0; i < refs->n; ++i) {
+        Macro *macro = lookup_macro(ctx, refs->arr[i].name);
+        if ((macro ? macro->serial : 0) != refs->arr[i].serial)
+            return 0;
     }
-    return NULL;
+    return 1;
 }
 
-void free_macro(Macro *macro)
+void clear_macro_refs(MacroRefList *refs)
+{
+    for (size_t i = 0; i < refs->n; ++i)
+        free(refs->arr[i].name);
+    refs->n = 0;
+}
+
+void free_macro(PpContext *ctx, Macro *macro)
 {
     // Free macro name
     free_token(macro->name);
@@ -269,65 +412,192 @@ void free_macro(Macro *macro)
     replace_list_free(&macro->replace_list);
 
     // Free formal parameters for function like macro
-    if (macro->function_like)
-        token_list_freeall(&macro->formals);
+    if (macro->function_like) {
+        for (size_t i = 0; i < macro->formals.n; ++i)
+            free_token(macro->formals.arr[i]);
+        formal_list_free(&macro->formals);
+    }
 
-    free(macro);
+    macro_pool_release(&ctx->macro_pool, macro);
 }
 
 void del_macro(PpContext *ctx, Token *token)
 {
-    Macro **macro, *tmp;
-
-    for (macro = &ctx->macros; *macro; macro = &(*macro)->next) {
-        // Delete macro if name matches, then return
-        if (!strcmp((*macro)->name->data, token->data)) {
-            tmp = (*macro)->next;
-            free_macro(*macro);
-            *macro = tmp;
-            return;
-        }
-    }
+    Macro **slot = macro_map_find(&ctx->macros, token->data);
+    if (!slot)
+        return;
+
+    // The earlier definition (if any) is visible again
+    Macro *macro = *slot;
+    if (macro->shadowed)
+        *slot = macro->shadowed;
+    else
+        macro_map_remove(&ctx->macros, token->data, NULL);
+    ++ctx->macro_gen;
+    // Checkpoints may still see it
+    if (!ctx->incr)
+        free_macro(ctx, macro);
 }
 
 PpContext *pp_create(void)
 {
     PpContext *ctx = calloc(1, sizeof *ctx);
+    arena_init(&ctx->arena);
     dirs_init(&ctx->search_dirs);
+    ctx->dirfd = AT_FDCWD;
+    ctx->err_fp = stderr;
+    frame_stack_init(&ctx->frames);
+    token_list_init(&ctx->pending);
+    invocation_stack_init(&ctx->invocations);
+    macro_map_init(&ctx->macros);
+    macro_pool_init(&ctx->macro_pool);
+    name_map_init(&ctx->names);
+    dep_list_init(&ctx->deps);
+    dep_map_init(&ctx->dep_paths);
+    include_list_init(&ctx->includes);
+    file_event_list_init(&ctx->file_events);
+    profile_list_init(&ctx->profiles);
+    profile_map_init(&ctx->profile_names);
+    prof_stack_init(&ctx->prof_frames);
     time_t rawtime = time(NULL);
-    ctx->start_time = localtime(&rawtime);
+    ctx->start_time = malloc(sizeof *ctx->start_time);
+    localtime_r(&rawtime, ctx->start_time);
     return ctx;
 }
 
 void pp_free(PpContext *ctx)
 {
+    if (ctx->pipe)
+        pp_pipe_free(ctx->pipe);
     dirs_free(&ctx->search_dirs);
-    while (ctx->frames) {
-        drop_frame(ctx);
-    }
-    for (Macro *m = ctx->macros; m; ) {
-        Macro *next = m->next;
-        free_macro(m);
-        m = next;
-    }
+    free(ctx->start_time);
+    free_frames(ctx);
+    free_invocations(ctx);
+    incr_free(ctx);
+    for (size_t i = 0; i < ctx->macros.size; ++i)
+        if (ctx->macros.arr[i].hash)
+            for (Macro *m = ctx->macros.arr[i].value; m; ) {
+                Macro *shadowed = m->shadowed;
+                free_macro(ctx, m);
+                m = shadowed;
+            }
+    macro_map_free(&ctx->macros);
+    macro_pool_free(&ctx->macro_pool);
+    free_hidesets(ctx);
+    free_if_memos(ctx);
+    free_memos(ctx);
+    profile_list_free(&ctx->profiles);
+    profile_map_free(&ctx->profile_names);
+    prof_stack_free(&ctx->prof_frames);
+    dep_list_free(&ctx->deps);
+    dep_map_free(&ctx->dep_paths);
+    include_list_free(&ctx->includes);
+    file_event_list_free(&ctx->file_events);
+    arena_free(&ctx->arena);
     free(ctx);
 }
 
+Arena *pp_arena(PpContext *ctx)
+{
+    return &ctx->arena;
+}
+
+void pp_set_err(PpContext *ctx, FILE *fp, void (*handler)(void *), void *arg)
+{
+    ctx->err_fp = fp;
+    ctx->err_handler = handler;
+    ctx->err_arg = arg;
+}
+
+void pp_set_dir(PpContext *ctx, int dirfd)
+{
+    ctx->dirfd = dirfd;
+}
+
 void pp_add_search_dir(PpContext *ctx, const char *dir)
 {
-    dirs_add(&ctx->search_dirs, dir);
+    dirs_add(&ctx->search_dirs, (SearchDir) { dir, 0 });
+}
+
+void pp_add_system_dir(PpContext *ctx, const char *dir)
+{
+    dirs_add(&ctx->search_dirs, (SearchDir) { dir, 1 });
 }
 
 int pp_push_file(PpContext *ctx, const char *path)
 {
-    LexCtx *lex = lex_open_file(path);
+    CachedFile *cached;
+    LexCtx *lex = cache_open_file(ctx->dirfd, path, &cached);
     if (!lex)
         return -1;
-    pp_push_lex_frame(ctx, lex);
+    pp_push_lex_frame(ctx, lex, cached);
+    frame_stack_top(&ctx->frames)->dep = pp_add_dep(ctx, path, 0);
     return 0;
 }
 
+void pp_scan(PpContext *ctx)
+{
+    Token *token;
+
+    // pp_read runs the directives, other lines are skipped after their first
+    // token, without lexing the rest
+    while ((token = pp_read(ctx))) {
+        if (token->type != TK_NEW_LINE)
+            lex_skip_line(frame_stack_top(&ctx->frames)->lex);
+        free_token(token);
+        ctx->file_events.n = 0;
+    }
+}
+
+void pp_report_includes(PpContext *ctx)
+{
+    ctx->report_includes = 1;
+}
+
+void pp_print_stats(PpContext *ctx, FILE *fp)
+{
+#ifdef PP_STATS
+    PpStats *stats = &ctx->stats;
+    fprintf(fp, "Pre-processor statistics:\n");
+    fprintf(fp, "  %-28s %zu\n", "Tokens lexed", stats->lexed);
+    fprintf(fp, "  %-28s %zu\n", "Tokens emitted", stats->emitted);
+    fprintf(fp, "  %-28s %zu\n", "Macros defined", stats->defines);
+    fprintf(fp, "  %-28s %zu\n", "Macros undefined", stats->undefs);
+    fprintf(fp, "  %-28s %zu\n", "Object-like expansions", stats->exp_object);
+    fprintf(fp, "  %-28s %zu\n", "Function-like expansions", stats->exp_function);
+    fprintf(fp, "  %-28s %zu\n", "Pre-defined expansions", stats->exp_predef);
+    fprintf(fp, "  %-28s %zu\n", "Actuals pre-expanded", stats->pre_expanded);
+    fprintf(fp, "  %-28s %zu\n", "## operators", stats->glues);
+    fprintf(fp, "  %-28s %zu\n", "Files entered", stats->files);
+    fprintf(fp, "  %-28s %zu\n", "Peak include depth", stats->max_include);
+    fprintf(fp, "  %-28s %zu\n", "Peak invocation depth", stats->max_invoke);
+    fprintf(fp, "  %-28s %zu\n", "Conditional blocks skipped", stats->skipped_conds);
+    fprintf(fp, "  %-28s %zu\n", "Lines skipped", stats->skipped_lines);
+    fprintf(fp, "  %-28s %zu\n", "Blocks skipped by the index", stats->indexed_skips);
+    fprintf(fp, "  %-28s %zu\n", "#include directives", stats->includes);
+    fprintf(fp, "  %-28s %zu\n", "Failed header opens", stats->failed_opens);
+    fprintf(fp, "  %-28s %zu\n", "#if expressions evaluated", stats->if_evals);
+    fprintf(fp, "  %-28s %zu\n", "#if results reused", stats->if_memo_hits);
+    fprintf(fp, "  %-28s %zu\n", "Arena bytes", ctx->arena.size);
+#else
+    (void) ctx;
+    fprintf(fp, "Pre-processor statistics are not compiled in, "
+                "rebuild with PP_STATS=1\n");
+#endif
+}
+
+_Bool pp_location(PpContext *ctx, PpLocation *loc)
+{
+    if (!ctx->frames.n)
+        return 0;
+    Frame *frame = frame_stack_top(&ctx->frames);
+    loc->path = lex_path(frame->lex);
+    loc->line = lex_line(frame->lex);
+    loc->depth = ctx->frames.n - 1;
+    return 1;
+}
+
 void pp_push_string(PpContext *ctx, const char *path, const char *str)
 {
-    pp_push_lex_frame(ctx, lex_open_string(path, str));
+    pp_push_lex_frame(ctx, lex_open_string(path, str), NULL);
 }
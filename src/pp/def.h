@@ -23,20 +23,51 @@ typedef struct {
 
 VEC_GEN(Replace, ReplaceList, replace_list)
 
+// Few macros have more formal parameters than fit inline
+VEC_GEN_SMALL(Token *, 4, FormalList, formal_list)
+
+//
+// Hidesets: interned sets of macro names
+//
+// Members are kept in descending order of their (interned) name's address,
+// thus two hidesets with the same members are always the same object.
+// The empty hideset is NULL.
+//
+
+typedef struct Hideset Hideset;
+struct Hideset {
+    const char  *name;     // Greatest member
+    Hideset     *rest;     // Hideset of the other members
+    Hideset     *children; // Interned hidesets with this one as their rest
+    Hideset     *sibling;  // Next hideset with the same rest
+};
+
+// Single member hidesets by their (interned) name
+HASH_GEN(const char *, Hideset *, NameMap, name_map, hash_str, hash_str_eq)
+
 typedef struct Macro Macro;
 struct Macro {
     Token       *name;         // Name of this macro
-    _Bool       enabled;       // Is this macro enabled?
+    size_t      serial;        // Number of the definition, unique per context
+    const char  *ident;        // Interned name (hideset member)
     _Bool       function_like; // Is this macro function like?
+    size_t      memo_hits;     // Invocations found memoized
+    size_t      memo_misses;   // Invocations memoized (or attempted)
+    size_t      profile;       // Index of its profile entry + 1 (0 if none)
     ReplaceList replace_list;  // Replacement list
 
     // Function-like macro-only
     _Bool       has_varargs;   // Does this macro have varargs parameter?
-    TokenList   formals;       // Formal parameters
+    FormalList  formals;       // Formal parameters
 
-    Macro     *next;
+    Macro     *shadowed;       // Earlier definition of the same name
 };
 
+POOL_GEN(Macro, MacroPool, macro_pool)
+
+// Macros by their (interned) name, the latest definitions
+HASH_GEN(const char *, Macro *, MacroMap, macro_map, hash_str, hash_str_eq)
+
 typedef enum {
     C_IF,    // #if, #ifdef, or #ifndef
     C_ELIF,  // #elif
@@ -46,47 +77,322 @@ typedef enum {
 
 VEC_GEN(Cond, CondList, cond_list)
 
-typedef enum {
-    F_LEXER,   // Directly from the lexer
-    F_LIST,    // List of tokens (stored in the frame)
-} FrameType;
-
-typedef struct Frame Frame;
-struct Frame {
-    FrameType type;
-    union {
-        // F_LEXER
-        struct {
-            LexCtx      *lex;     // Lexer context
-            CondList    conds;    // Conditional inclusion stack
-        };
-        // F_LIST
-        struct {
-            Macro       *source;  // Originating macro
-            TokenList   list;     // List of tokens
-            size_t      i;        // Current index into the list
-        };
-    };
-    Frame *next;
-};
+// File in the process wide cache
+typedef struct CachedFile CachedFile;
+
+// NOTE: frames are pooled, the storage of conds is kept across pushes and
+// pops of the frame slot
+typedef struct {
+    LexCtx      *lex;     // Lexer context
+    _Bool       system;   // Is this a system header?
+    CondList    conds;    // Conditional inclusion stack
+    size_t      tokens;   // Tokens lexed
+    size_t      macros;   // Macros defined
+    size_t      include;  // Index of the include report entry
+    const char  *dep;     // Dependency path of the file, NULL for strings
+    CachedFile  *cached;  // Cache entry of the file, if read through it
+} Frame;
+
+VEC_GEN(Frame, FrameStack, frame_stack)
+
+// Actual parameter of a function like macro invocation
+typedef struct {
+    TokenList   tokens;     // Tokens making up the actual parameter
+    _Bool       pre_expand; // Is the parameter used outside # and ##?
+    TokenList   expansion;  // Fully macro replaced tokens
+} Actual;
+
+VEC_GEN(Actual, ActualList, actual_list)
+
+// Function like macro invocation waiting for its actuals to be pre-expanded
+typedef struct {
+    Macro       *macro;   // Invoked macro
+    _Bool       lwhite;   // Spacing of the macro name
+    Hideset     *hideset; // Hideset of the expansion
+    ActualList  actuals;  // Actual parameters (storage is kept when done)
+    size_t      cur;      // Actual currently being pre-expanded
+    double      start;    // Time the invocation started (when profiling)
+} Invocation;
+
+// NOTE: invocations are pooled like frames, but stored as pointers, as
+// capturing the actuals of one can run a directive starting others
+VEC_GEN(Invocation *, InvocationStack, invocation_stack)
+
+//
+// Statistics counters, only compiled in with PP_STATS
+//
+
+typedef struct {
+    size_t lexed;         // Tokens read from lexers
+    size_t emitted;       // Tokens returned by pp_next
+    size_t defines;       // Macros defined
+    size_t undefs;        // Macros undefined
+    size_t exp_object;    // Object-like macro expansions
+    size_t exp_function;  // Function-like macro expansions
+    size_t exp_predef;    // Pre-defined macro expansions
+    size_t pre_expanded;  // Actuals pre-expanded
+    size_t glues;         // ## operators evaluated
+    size_t files;         // Files entered (the main file and headers)
+    size_t max_include;   // Peak include depth (0 for the main file)
+    size_t max_invoke;    // Peak depth of nested invocations
+    size_t skipped_conds; // Conditional blocks skipped
+    size_t skipped_lines; // Lines skipped inside those
+    size_t includes;      // #include directives
+    size_t failed_opens;  // Header search misses
+    size_t if_memo_hits;  // #if/#elif results reused
+    size_t if_evals;      // #if/#elif expressions evaluated
+    size_t indexed_skips; // Conditional blocks skipped with the index
+} PpStats;
+
+#ifdef PP_STATS
+#define PP_STAT(ctx, name) ((void) ++(ctx)->stats.name)
+#define PP_STAT_MAX(ctx, name, val) \
+    ((void) ((ctx)->stats.name < (val) && ((ctx)->stats.name = (val))))
+#else
+#define PP_STAT(ctx, name) ((void) 0)
+#define PP_STAT_MAX(ctx, name, val) ((void) 0)
+#endif
+
+//
+// Macro expansion profile
+//
+
+// Cost of the expansions of every macro with the same name
+typedef struct {
+    const char  *name;         // Interned name
+    size_t      invocations;   // Expansions (including memoized ones)
+    size_t      tokens;        // Tokens produced, including by nested macros
+    size_t      max_depth;     // Deepest nesting of an expansion
+    size_t      pre_expanded;  // Actuals pre-expanded
+    double      pre_time;      // Time until the actuals were pre-expanded
+    double      time;          // Inclusive time
+} MacroProfile;
+
+VEC_GEN(MacroProfile, ProfileList, profile_list)
+
+// Index of each profile entry by its (interned) name
+HASH_GEN(const char *, size_t, ProfileMap, profile_map, hash_ptr, hash_ptr_eq)
+
+// Expansion being profiled, it ends once reading goes below its tokens
+typedef struct {
+    size_t      profile;  // Index of the profile entry
+    size_t      level;    // Number of pending tokens below the expansion
+    double      start;    // Time the invocation started
+    size_t      tokens;   // Tokens produced before it
+} ProfFrame;
+
+VEC_GEN(ProfFrame, ProfStack, prof_stack)
 
 //
 // Preprocessor context
 //
 
-VEC_GEN(const char *, SearchDirs, dirs)
+// Header search directory
+typedef struct {
+    const char  *path;
+    _Bool       system;   // Are headers found in there system headers?
+} SearchDir;
+
+VEC_GEN(SearchDir, SearchDirs, dirs)
+
+// File read by the pre-processor
+typedef struct {
+    const char  *path;    // Path the file was opened with
+    _Bool       system;   // Was it included by a system header or as one?
+} Dep;
+
+VEC_GEN(Dep, DepList, dep_list)
+
+// Index of each file in the dependencies by its path
+HASH_GEN(const char *, size_t, DepMap, dep_map, hash_str, hash_str_eq)
+
+// Reading of a file, for the include report
+typedef struct {
+    const char  *path;    // Path the file was opened with
+    size_t      depth;    // Include depth
+    double      start;    // Time the file was opened at
+    double      time;     // Wall time until it was closed (inclusive)
+    size_t      tokens;   // Tokens lexed from the file itself
+    size_t      macros;   // Macros defined by the file itself
+} Include;
+
+VEC_GEN(Include, IncludeList, include_list)
+
+// File entered by an #include, or returned to at the end of one, for the
+// line markers of the output
+typedef struct {
+    _Bool       enter;     // Entering the file, or returning to it?
+    const char  *path;     // Path of the file (kept as long as the context)
+    size_t      line;      // Line it's read from next
+    const char  *from;     // File and line of the #include (if entering)
+    size_t      from_line;
+} FileEvent;
+
+VEC_GEN(FileEvent, FileEventList, file_event_list)
+
+// Macro lookup made while evaluating an #if/#elif expression
+typedef struct {
+    char        *name;    // Name looked up
+    size_t      serial;   // Serial of the macro found, 0 if none
+} MacroRef;
+
+VEC_GEN(MacroRef, MacroRefList, macro_ref_list)
+
+// Number of hash buckets of the #if/#elif results
+#define IF_MEMO_BUCKETS 1024
+
+// Result of the #if/#elif expression at a location, it's still valid as long
+// as the same lookups find the same macros
+typedef struct IfMemo IfMemo;
+struct IfMemo {
+    const char   *dep;      // Dependency path of the file
+    size_t       line;      // Line of the directive
+    _Bool        evaluated; // Was the expression evaluated yet?
+    _Bool        value;     // Result of the expression
+    MacroRefList refs;      // Macro lookups made evaluating it
+    IfMemo       *next;     // Next result in the same bucket
+};
+
+// Number of hash buckets of the memoized invocations
+#define MEMO_BUCKETS 4096
+
+// Fully rescanned expansion of a function-like macro invocation, it's still
+// valid as long as the same lookups find the same macros
+typedef struct MacroMemo MacroMemo;
+struct MacroMemo {
+    size_t       serial;    // Serial of the invoked macro
+    char         *actuals;  // Spellings of the actuals
+    size_t       hash;      // Hash of the above
+    MacroRefList refs;      // Macro lookups made expanding it
+    TokenList    tokens;    // Expansion
+    Token        *end;      // Marks the end of the expansion while recording
+    _Bool        failed;    // Did the expansion depend on its location?
+    MacroMemo    *next;     // Next entry in the same bucket
+};
+
+//
+// Incremental re-runs over an edited main file
+//
+
+// Every macro defined, in order
+VEC_GEN(Macro *, MacroList, macro_list)
+
+// Point of the main file the output can be resumed from
+typedef struct {
+    LexPos        pos;        // Lexer position in the main file
+    size_t        tokens;     // Tokens lexed from the main file before it
+    MacroMapEntry *macros;    // Slots of the macro table
+    size_t        nmacros, macros_size;
+    _Bool         shared;     // Are the slots those of the previous one?
+    size_t        macro_gen;  // Changes to the macro table before it
+    size_t        defined;    // Macros defined before it
+    CondList      conds;      // Conditional inclusion stack of the main file
+    size_t        deps;       // Files read before it
+    // Output written before it, and the output state at that point
+    size_t        out_len;
+    char          *out_path;
+    size_t        out_line;
+    _Bool         out_dirty;
+} Checkpoint;
+
+VEC_GEN(Checkpoint, CheckpointList, checkpoint_list)
+
+// Version of a file read, to tell if it changed since
+typedef struct {
+    dev_t           dev;
+    ino_t           ino;
+    off_t           size;
+    struct timespec mtime;
+} DepStat;
+
+VEC_GEN(DepStat, DepStatList, dep_stat_list)
+
+typedef struct {
+    char           *path;     // Main file
+    char           *source;   // Contents it was last written from
+    size_t         len;
+    CheckpointList checkpoints;
+    MacroList      defined;   // Every macro defined
+    DepStatList    stats;     // Versions of the files read (as of checkpoints)
+    StringBuilder  output;    // Everything written
+    void           *out;      // Output state (kept across runs)
+} Incremental;
 
 struct PpContext {
-    // Parent context for pre-expansion
-    PpContext *parent;
+    // Memory living as long as the context: hidesets, interned names, file
+    // paths and the output state
+    Arena arena;
     // Header search directories
     SearchDirs search_dirs;
+    // Directory relative paths are opened from
+    int dirfd;
+    // Error output, and handler called instead of exiting
+    FILE *err_fp;
+    void (*err_handler)(void *);
+    void *err_arg;
+    // Output being written (if any), flushed before an error is reported
+    void *out;
     // Translation time and date
     struct tm *start_time;
-    // Preprocessor frames
-    Frame *frames;
-    // Defined macros
-    Macro *macros;
+    // Preprocessor frames (one for each file being read)
+    FrameStack frames;
+    // Number of frame slots with initialized storage
+    size_t frames_pooled;
+    // Tokens to read before the frames (last one first), macro expansions
+    // are spliced in here, NULL marks the end of an isolated sequence
+    TokenList pending;
+    // Macro invocations with actuals being pre-expanded
+    InvocationStack invocations;
+    // Number of invocation slots allocated
+    size_t invocations_pooled;
+    // Defined macros, and the serial of the last one
+    MacroMap macros;
+    size_t macro_serial;
+    // Definitions and removals so far
+    size_t macro_gen;
+    MacroPool macro_pool;
+    // Results of #if/#elif expressions
+    IfMemo **if_memos;
+    // Macro lookups made for the result being memoized (if any)
+    MacroRefList *lookups;
+    // Memoized function-like macro invocations, the one being recorded, and
+    // the memory used by them and its limit (0 disables memoization)
+    MacroMemo **memos;
+    MacroMemo *memo;
+    size_t memo_bytes, memo_budget;
+    // Memoized expansion being returned by pp_next
+    TokenList *replay;
+    size_t replay_pos;
+    _Bool replay_lwhite;
+    // Number of isolated sequences in the pending tokens
+    size_t isolated;
+    // Macro expansion profile, the expansions being profiled, and the
+    // tokens produced so far
+    _Bool profile;
+    ProfileList profiles;
+    ProfileMap profile_names;
+    ProfStack prof_frames;
+    size_t prof_tokens;
+    // Interned single member hidesets (the children of the empty hideset),
+    // and the same by name
+    Hideset *hidesets;
+    NameMap names;
+    // Files read so far (dependencies of the output)
+    DepList deps;
+    DepMap dep_paths;
+    // Include report, in the order the files were opened
+    _Bool report_includes;
+    IncludeList includes;
+    // Files entered and returned to by the last call of pp_next
+    FileEventList file_events;
+    // Checkpoints of the main file (when written incrementally)
+    Incremental *incr;
+    // Thread pre-processing ahead of the reader (if any)
+    PpPipe *pipe;
+#ifdef PP_STATS
+    // Statistics counters
+    PpStats stats;
+#endif
 };
 
 //
@@ -102,22 +408,101 @@ typedef struct {
 
 Predef *find_predef(Token *identifier);
 
+// Monotonic wall clock time in seconds
+double wall_time(void);
+
 // Pre-processor stack manipulation
-void pp_push_lex_frame(PpContext *ctx, LexCtx *lex);
-TokenList *pp_push_list_frame(PpContext *ctx, Macro *source);
+void pp_push_lex_frame(PpContext *ctx, LexCtx *lex, CachedFile *cached);
+// Pop the top frame, freeing its lexer
+void drop_frame(PpContext *ctx);
+// Record entering the file of the top frame from an #include
+void pp_enter_file(PpContext *ctx);
+// Leave through the error handler, once the error is reported
+void __attribute__((noreturn)) pp_fail(PpContext *ctx);
+// Open a lexer context for a file, through the file cache if enabled, sets
+// cached to the cache entry it's reading from (if any)
+LexCtx *cache_open_file(int dirfd, const char *path, CachedFile **cached);
+// Stop reading a file opened through the cache
+void cache_close(CachedFile *file);
+// Find where skipping a conditional block from an offset of a cached file
+// ended before, the first directive ending it is #else/#elif if else_elif
+_Bool cache_find_skip(CachedFile *file, size_t start, _Bool else_elif,
+                      LexPos *end, Cond *cond);
+// Add where skipping a block ended to the index of a cached file
+void cache_add_skip(CachedFile *file, size_t start, _Bool else_elif,
+                    const LexPos *end, Cond cond);
+// Record a file being read as a dependency, returns the path kept for it
+const char *pp_add_dep(PpContext *ctx, const char *path, _Bool system);
 // Read the next token
 Token *pp_read(PpContext *ctx);
+// Push back a token to be returned by the next pp_read
+void pp_unread(PpContext *ctx, Token *token);
+// Reverse the tokens added to ctx->pending since start, so they are read in
+// the order they were added
+void pp_flip_pending(PpContext *ctx, size_t start);
+// Start an isolated sequence of pending tokens: pp_read returns NULL once
+// it reaches the end of it, until it's popped
+void pp_push_isolated(PpContext *ctx);
+void pp_pop_isolated(PpContext *ctx);
 
 // Macro database manipulation
-Macro *new_macro(PpContext *ctx);
+// Define a macro, hiding any earlier definition of the name
+Macro *new_macro(PpContext *ctx, Token *name);
 Macro *find_macro(PpContext *ctx, Token *token);
-void free_macro(Macro *macro);
+// Same, by name, and without recording the lookup for #if results
+Macro *lookup_macro(PpContext *ctx, const char *name);
+// Do recorded lookups still find the same macros?
+_Bool macro_refs_valid(PpContext *ctx, MacroRefList *refs);
+// Free recorded lookups, keeping the storage of the list
+void clear_macro_refs(MacroRefList *refs);
+void free_macro(PpContext *ctx, Macro *macro);
 void del_macro(PpContext *ctx, Token *token);
 
+// Free the pooled macro invocations
+void free_invocations(PpContext *ctx);
+
+// Find the memoized expansion of an invocation at the top level, or start
+// memoizing it, returns NULL if it has to be expanded
+TokenList *memo_find(PpContext *ctx, Token *identifier, Macro *macro,
+                     Actual actuals[], Hideset *rparen_hs);
+// End memoizing at the end of its expansion, clean is 0 if something read
+// past it (so the rest of the input was part of the expansion)
+void memo_end(PpContext *ctx, _Bool clean);
+void free_memos(PpContext *ctx);
+
+// Profile entry of a macro
+MacroProfile *prof_entry(PpContext *ctx, Macro *macro);
+// Start profiling an expansion about to be added to the pending tokens
+void prof_begin(PpContext *ctx, Macro *macro, double start);
+// End the innermost expansion being profiled
+void prof_end(PpContext *ctx);
+
+// Hideset manipulation
+const char *intern_name(PpContext *ctx, const char *name);
+Hideset *hs_add(PpContext *ctx, Hideset *hs, const char *name);
+void free_hidesets(PpContext *ctx);
+
+// Start writing the main file incrementally, restoring the last checkpoint
+// still valid for its contents (or taking the first one), and return it
+Checkpoint *incr_begin(PpContext *ctx, const char *path, const char *str);
+// Take a checkpoint at the end of a line of the main file, if one is due and
+// nothing is in flight, the caller fills in the output state
+Checkpoint *incr_checkpoint(PpContext *ctx, size_t out_len);
+void incr_free(PpContext *ctx);
+
+// Write out the buffered output of ctx->out
+void out_flush_buffer(void *out);
+// Set the output a pipe flushes before reporting an error
+void pipe_set_out(PpPipe *pipe, void *out);
+// Files entered and returned to by the last call of pp_pipe_next
+FileEventList *pipe_file_events(PpPipe *pipe);
+
 // Evaluate a constant expression
 long eval_cexpr(PpContext *pp);
 
 // Handle a pre-processor directive
 void handle_directive(PpContext *ctx);
+// Free the results of #if/#elif expressions
+void free_if_memos(PpContext *ctx);
 
 #endif
@@ -8,29 +8,43 @@
 #include <stdio.h>
 #include <limits.h>
 #include <vec.h>
+#include <hash.h>
+#include <pool.h>
+#include <arena.h>
 #include <lex/token.h>
 #include <lex/lex.h>
 #include "pp.h"
 #include "def.h"
 
+// Get the frame of the file currently being read
+static Frame *dir_frame(PpContext *ctx)
+{
+    assert(ctx->frames.n);
+    return frame_stack_top(&ctx->frames);
+}
+
 // Read from the current pre-processor frame's underlying lexer context
 static Token *dir_read(PpContext *ctx)
 {
-    assert(ctx->frames && ctx->frames->type == F_LEXER);
-    return lex_next(ctx->frames->lex);
+    Frame *frame = dir_frame(ctx);
+    Token *token = lex_next(frame->lex);
+    if (token) {
+        ++frame->tokens;
+        PP_STAT(ctx, lexed);
+    }
+    return token;
 }
 
 static void push_cond(PpContext *ctx, Cond cond)
 {
-    assert(ctx->frames && ctx->frames->type == F_LEXER);
-    cond_list_add(&ctx->frames->conds, cond);
+    cond_list_add(&dir_frame(ctx)->conds, cond);
 }
 
 static int pop_cond(PpContext *ctx)
 {
-    assert(ctx->frames && ctx->frames->type == F_LEXER);
-    if (ctx->frames->conds.n > 0)
-        return cond_list_pop(&ctx->frames->conds);
+    Frame *frame = dir_frame(ctx);
+    if (frame->conds.n > 0)
+        return cond_list_pop(&frame->conds);
     return -1;
 }
 
@@ -71,7 +85,7 @@ static Token *capture_formals_read(PpContext *ctx)
 static void capture_formals(PpContext *ctx, Macro *macro)
 {
     macro->has_varargs = 0;
-    token_list_init(&macro->formals);
+    formal_list_init(&macro->formals);
 
     // If the first token is ), it's a 0 parameter macro
     Token *token = capture_formals_read(ctx);
@@ -104,7 +118,7 @@ static void capture_formals(PpContext *ctx, Macro *macro)
         }
 
         // Add token to formal parameter list
-        token_list_add(&macro->formals, token);
+        formal_list_add(&macro->formals, token);
 
         // Next token must be either , or )
         token = capture_formals_read(ctx);
@@ -196,9 +210,9 @@ static void dir_define(PpContext *ctx)
         pp_err(ctx, "Macro name must be an identifier");
 
     // Put macro name into database and get pointer to struct
-    Macro *macro = new_macro(ctx);
-    macro->name = token;
-    macro->enabled = 1;
+    PP_STAT(ctx, defines);
+    ++dir_frame(ctx)->macros;
+    Macro *macro = new_macro(ctx, token);
 
     // Check for macro type
     token = dir_read(ctx);
@@ -218,6 +232,15 @@ static void dir_define(PpContext *ctx)
     }
 
     // NOTE: capture_replace_list already consumed the terminating newline
+
+    // Replacement list tokens start out with the hideset of a non-nested
+    // expansion, so those don't need to copy them
+    Hideset *hideset = hs_add(ctx, NULL, macro->ident);
+    for (size_t i = 0; i < macro->replace_list.n; ++i) {
+        Replace *replace = macro->replace_list.arr + i;
+        if (replace->type == R_TOKEN)
+            replace->token->hideset = hideset;
+    }
 }
 
 static void dir_undef(PpContext *ctx)
@@ -228,6 +251,7 @@ static void dir_undef(PpContext *ctx)
         pp_err(ctx, "Macro name must be an identifier");
 
     // Delete macro
+    PP_STAT(ctx, undefs);
     del_macro(ctx, token);
     free_token(token);
 
@@ -267,12 +291,71 @@ err:
     pp_err(ctx, "Missing/malformed argument for defined operator");
 }
 
+//
+// Results of #if/#elif expressions are kept per location, headers included
+// many times evaluate the same expressions again and again. A result is
+// reused as long as every macro lookup made for it finds the same definition,
+// otherwise the expression is evaluated again.
+//
+
+// Find the result of the expression at a location, adding an empty one
+static IfMemo *find_if_memo(PpContext *ctx, const char *dep, size_t line)
+{
+    if (!ctx->if_memos)
+        ctx->if_memos = calloc(IF_MEMO_BUCKETS, sizeof *ctx->if_memos);
+
+    IfMemo **bucket = ctx->if_memos
+        + ((size_t) dep / sizeof (void *) * 31 + line) % IF_MEMO_BUCKETS;
+    IfMemo *memo;
+    for (memo = *bucket; memo; memo = memo->next)
+        if (memo->dep == dep && memo->line == line)
+            return memo;
+
+    memo = calloc(1, sizeof *memo);
+    memo->dep = dep;
+    memo->line = line;
+    macro_ref_list_init(&memo->refs);
+    memo->next = *bucket;
+    *bucket = memo;
+    return memo;
+}
+
+void free_if_memos(PpContext *ctx)
+{
+    if (!ctx->if_memos)
+        return;
+    for (size_t i = 0; i < IF_MEMO_BUCKETS; ++i)
+        for (IfMemo *memo = ctx->if_memos[i]; memo; ) {
+            IfMemo *next = memo->next;
+            clear_macro_refs(&memo->refs);
+            macro_ref_list_free(&memo->refs);
+            free(memo);
+            memo = next;
+        }
+    free(ctx->if_memos);
+}
+
 static _Bool eval_if(PpContext *ctx)
 {
-    PpContext subctx = { .parent = ctx, .frames = NULL, .macros = ctx->macros };
-    TokenList *list = pp_push_list_frame(&subctx, NULL);
+    // Reuse the result from the last time, strings have no stable location
+    Frame *frame = dir_frame(ctx);
+    IfMemo *memo = NULL;
+    if (frame->dep) {
+        memo = find_if_memo(ctx, frame->dep, lex_line(frame->lex));
+        if (memo->evaluated && macro_refs_valid(ctx, &memo->refs)) {
+            PP_STAT(ctx, if_memo_hits);
+            lex_skip_line(frame->lex);
+            return memo->value;
+        }
+        clear_macro_refs(&memo->refs);
+        ctx->lookups = &memo->refs;
+    }
+    PP_STAT(ctx, if_evals);
 
-    // Capture constant expression, evaluating the defined operator
+    // Capture constant expression as an isolated sequence, evaluating the
+    // defined operator
+    pp_push_isolated(ctx);
+    size_t start = ctx->pending.n;
     for (;;) {
         Token *token = dir_read(ctx);
         if (!token)
@@ -285,11 +368,20 @@ static _Bool eval_if(PpContext *ctx)
             free_token(token);
             token = defined_operator(ctx);
         }
-        token_list_add(list, token);
+        token_list_add(&ctx->pending, token);
     }
+    pp_flip_pending(ctx, start);
 
     // Evaluate the constant expression
-    return eval_cexpr(&subctx);
+    _Bool result = eval_cexpr(ctx);
+    pp_pop_isolated(ctx);
+
+    ctx->lookups = NULL;
+    if (memo) {
+        memo->value = result;
+        memo->evaluated = 1;
+    }
+    return result;
 }
 
 static _Bool eval_ifdef(PpContext *ctx)
@@ -309,13 +401,18 @@ static _Bool eval_ifdef(PpContext *ctx)
     return macro_defined;
 }
 
-// Find the end or alternative branch of non-evaluated conditional
-static Cond skip_cond(PpContext *ctx, _Bool want_else_elif)
+// Read through a non-evaluated conditional, to its end or alternative branch
+static Cond scan_cond(PpContext *ctx, _Bool want_else_elif)
 {
     for (size_t nest = 1; nest; ) {
+        PP_STAT(ctx, skipped_lines);
         Token *token = dir_read(ctx);
         if (!token)
             pp_err(ctx, "Unterminated conditional inclusion");
+        if (token->type == TK_NEW_LINE) {
+            free_token(token);
+            continue;
+        }
 
         // Look for nested #if
         if (token->type == TK_HASH && token->flags.directive) {
@@ -323,11 +420,15 @@ static Cond skip_cond(PpContext *ctx, _Bool want_else_elif)
 
             // Read directive name, skipping empty or invalid directives
             token = dir_read(ctx);
-            if (!token || token->type != TK_IDENTIFIER)
+            if (!token)
+                continue;
+            if (token->type == TK_NEW_LINE) {
+                free_token(token);
                 continue;
+            }
 
             // Check for alternative branch of the outer conditional if requested
-            if (want_else_elif && nest == 1) {
+            if (want_else_elif && nest == 1 && token->type == TK_IDENTIFIER) {
                 if (!strcmp("else", token->data)) {
                     free_token(token);
                     return C_ELSE;
@@ -340,21 +441,50 @@ static Cond skip_cond(PpContext *ctx, _Bool want_else_elif)
             }
 
             // Check for nested #if directive
-            if (!strcmp("if", token->data)
-                    || !strcmp("ifdef", token->data)
-                    || !strcmp("ifndef", token->data))
-                ++nest;
-            else if (!strcmp("endif", token->data))
-                --nest;
+            if (token->type == TK_IDENTIFIER) {
+                if (!strcmp("if", token->data)
+                        || !strcmp("ifdef", token->data)
+                        || !strcmp("ifndef", token->data))
+                    ++nest;
+                else if (!strcmp("endif", token->data))
+                    --nest;
+            }
         }
 
+        // Nothing else on the line matters, skip it without lexing, except
+        // for the closing #endif that dir_expect_newline checks
         free_token(token);
+        if (nest)
+            lex_skip_line(dir_frame(ctx)->lex);
     }
 
     // Nesting level reacing 0 means #endif
     return C_ENDIF;
 }
 
+// Find the end or alternative branch of non-evaluated conditional
+static Cond skip_cond(PpContext *ctx, _Bool want_else_elif)
+{
+    PP_STAT(ctx, skipped_conds);
+
+    // Files in the cache know where their blocks ended the last time
+    Frame *frame = dir_frame(ctx);
+    LexPos start, end;
+    Cond cond;
+    _Bool indexed = frame->cached && lex_tell(frame->lex, &start);
+    if (indexed && cache_find_skip(frame->cached, start.offset,
+            want_else_elif, &end, &cond)) {
+        PP_STAT(ctx, indexed_skips);
+        lex_seek(frame->lex, &end);
+        return cond;
+    }
+
+    cond = scan_cond(ctx, want_else_elif);
+    if (indexed && lex_tell(frame->lex, &end))
+        cache_add_skip(frame->cached, start.offset, want_else_elif, &end, cond);
+    return cond;
+}
+
 // Handle #if/#ifdef/#ifndef directives
 static void dir_if(PpContext *ctx, _Bool condition)
 {
@@ -408,27 +538,38 @@ static void dir_endif(PpContext *ctx)
     dir_expect_newline(ctx);
 }
 
-static LexCtx *open_system_header(PpContext *ctx, const char *name)
+// Search a header in the search directories, sets system if it was found in
+// a system header directory
+static LexCtx *open_system_header(PpContext *ctx, const char *name,
+                                  CachedFile **cached, _Bool *system)
 {
     char path[PATH_MAX];
     LexCtx *lex;
 
     for (size_t i = 0; i < ctx->search_dirs.n; ++i) {
-        snprintf(path, sizeof path, "%s/%s", ctx->search_dirs.arr[i], name);
-        if ((lex = lex_open_file(path)))
+        SearchDir *dir = ctx->search_dirs.arr + i;
+        snprintf(path, sizeof path, "%s/%s", dir->path, name);
+        if ((lex = cache_open_file(ctx->dirfd, path, cached))) {
+            *system = dir->system;
             return lex;
+        }
+        PP_STAT(ctx, failed_opens);
     }
 
     return NULL;
 }
 
-static LexCtx *open_local_header(PpContext *ctx, const char *name)
+static LexCtx *open_local_header(PpContext *ctx, const char *name,
+                                 CachedFile **cached, _Bool *system)
 {
     LexCtx *lex;
 
     // Retry failed local header as a system one
-    if (!(lex = lex_open_file(name)))
-        return open_system_header(ctx, name);
+    if (!(lex = cache_open_file(ctx->dirfd, name, cached))) {
+        PP_STAT(ctx, failed_opens);
+        return open_system_header(ctx, name, cached, system);
+    }
+    *system = 0;
     return lex;
 }
 
@@ -465,25 +606,24 @@ static char *read_qchar(Token *token)
 // #include directive
 static void dir_include(PpContext *ctx)
 {
+    PP_STAT(ctx, includes);
     Token *token = dir_read(ctx);
     if (!token)
         goto err_invalid;
 
     char *name;
-    LexCtx *lex;
+    _Bool angle = token->type == TK_LEFT_ANGLE;
 
     switch (token->type) {
     case TK_LEFT_ANGLE:
         name = read_hchar(ctx);
         if (name == NULL)
             goto err_invalid;
-        lex = open_system_header(ctx, name);
         break;
     case TK_STRING_LIT:
         name = read_qchar(token);
         if (name == NULL)
             goto err_invalid;
-        lex = open_local_header(ctx, name);
         break;
     default:
         goto err_invalid;
@@ -491,10 +631,25 @@ static void dir_include(PpContext *ctx)
     free_token(token);
     dir_expect_newline(ctx);
 
+    // NOTE: opened once the directive is done, so an error in it doesn't
+    // leave the file open
+    LexCtx *lex;
+    CachedFile *cached;
+    _Bool system;
+    if (angle)
+        lex = open_system_header(ctx, name, &cached, &system);
+    else
+        lex = open_local_header(ctx, name, &cached, &system);
     if (!lex)
         pp_err(ctx, "Can't locate header file: %s", name);
     free(name);
-    pp_push_lex_frame(ctx, lex);
+    // Headers found in system directories, or included by system headers,
+    // are system headers
+    system = system || dir_frame(ctx)->system;
+    pp_push_lex_frame(ctx, lex, cached);
+    dir_frame(ctx)->system = system;
+    dir_frame(ctx)->dep = pp_add_dep(ctx, lex_path(lex), system);
+    pp_enter_file(ctx);
     return;
 
 err_invalid:
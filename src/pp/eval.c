@@ -8,6 +8,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <vec.h>
+#include <hash.h>
+#include <pool.h>
+#include <arena.h>
 #include <err.h>
 #include <lex/token.h>
 #include <lex/lex.h>
@@ -17,12 +20,62 @@
 typedef struct {
     PpContext *pp;
     Token *cur;
+    // Parsing an operand whose value is not used (right of 0 && or 1 ||, or
+    // the branch of ?: not taken)
+    _Bool dead;
 } EvalCtx;
 
+// Skip the actual parameters of a macro invocation, up to the closing )
+static void skip_actuals(EvalCtx *ctx)
+{
+    for (size_t depth = 1; depth; ) {
+        Token *token = pp_read(ctx->pp);
+        if (!token)
+            pp_err(ctx->pp, "Unexpected end of actual parameters");
+        if (token->type == TK_LEFT_PAREN)
+            ++depth;
+        else if (token->type == TK_RIGHT_PAREN)
+            --depth;
+        free_token(token);
+    }
+}
+
+//
+// Read the next token of the expression
+//
+// Invocations of function-like macros in dead operands are skipped without
+// expanding them, they take the place of a single operand. Anything else is
+// still macro replaced, so the syntax is checked the same way.
+//
+static Token *eval_read(EvalCtx *ctx)
+{
+    if (!ctx->dead)
+        return pp_next(ctx->pp);
+
+    Token *token = pp_read(ctx->pp);
+    if (!token || token->type != TK_IDENTIFIER)
+        return token;
+    // NOTE: names coming from an expansion might be hidden, those are left to
+    // pp_next
+    Macro *macro = find_macro(ctx->pp, token);
+    if (macro && macro->function_like && !token->hideset) {
+        Token *lparen = pp_read(ctx->pp);
+        if (lparen && lparen->type == TK_LEFT_PAREN) {
+            free_token(lparen);
+            skip_actuals(ctx);
+            return token;
+        }
+        if (lparen)
+            pp_unread(ctx->pp, lparen);
+    }
+    pp_unread(ctx->pp, token);
+    return pp_next(ctx->pp);
+}
+
 static Token *eval_next(EvalCtx *ctx, TokenType type)
 {
     if (!ctx->cur)
-        ctx->cur = pp_next(ctx->pp);
+        ctx->cur = eval_read(ctx);
     if (ctx->cur && ctx->cur->type == type) {
         Token *cur = ctx->cur;
         ctx->cur = NULL;
@@ -210,7 +263,7 @@ err:
 static int peak_bop(EvalCtx *ctx)
 {
     if (!ctx->cur)
-        ctx->cur = pp_next(ctx->pp);
+        ctx->cur = eval_read(ctx);
     if (ctx->cur) {
         switch (ctx->cur->type) {
         case TK_STAR:           break;
@@ -330,6 +383,10 @@ long p_binary(EvalCtx *ctx, long lhs, int min_precedence)
         // Consume operator token
         free_token(ctx->cur);
         ctx->cur = NULL;
+        // The RHS of && and || is dead if the LHS decides the result
+        _Bool dead = ctx->dead;
+        if ((op == TK_LOGIC_AND && !lhs) || (op == TK_LOGIC_OR && lhs))
+            ctx->dead = 1;
         // Read RHS
         long rhs = p_unary(ctx);
         // Recurse on operators with greater precedence
@@ -339,8 +396,15 @@ long p_binary(EvalCtx *ctx, long lhs, int min_precedence)
                 break;
             rhs = p_binary(ctx, rhs, precedences[next_op]);
         }
-        // Evaluate current operand
-        lhs = eval_bop(op, lhs, rhs);
+        // Evaluate current operand, dead ones don't compute anything
+        if (!ctx->dead) {
+            if ((op == TK_FWD_SLASH || op == TK_PERCENT) && !rhs)
+                pp_err(ctx->pp, "Division by zero in constant expression");
+            lhs = eval_bop(op, lhs, rhs);
+        }
+        else if (!dead)
+            lhs = op == TK_LOGIC_OR;
+        ctx->dead = dead;
     }
 }
 
@@ -351,13 +415,17 @@ long p_cond(EvalCtx *ctx)
     // Look for ? for conditional
     if (!eval_match(ctx, TK_QUEST_MARK))
         return l;
-    // Middle
+    // Middle, dead unless the condition is true
+    _Bool dead = ctx->dead;
+    ctx->dead = dead || !l;
     long m = p_cond(ctx);
     // Error on missing :
     if (!eval_match(ctx, TK_COLON))
         pp_err(ctx->pp, "Missing : from trinary conditional");
-    // Right
+    // Right, dead unless the condition is false
+    ctx->dead = dead || l;
     long r = p_cond(ctx);
+    ctx->dead = dead;
     // Evaluate
     return l ? m : r;
 }
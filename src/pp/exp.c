@@ -8,51 +8,196 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <limits.h>
+#include <stdint.h>
 #include <vec.h>
+#include <hash.h>
+#include <pool.h>
+#include <arena.h>
 #include <lex/token.h>
 #include <lex/lex.h>
 #include "pp.h"
 #include "def.h"
 
+// Find or create the interned hideset with a greatest member and the rest
+static Hideset *hs_intern(PpContext *ctx, const char *name, Hideset *rest)
+{
+    Hideset **list = rest ? &rest->children : &ctx->hidesets;
+    if (rest) {
+        for (Hideset *hs = *list; hs; hs = hs->sibling)
+            if (hs->name == name)
+                return hs;
+    } else {
+        // There is one for every interned name, they are found by name
+        Hideset **hs = name_map_find(&ctx->names, name);
+        if (hs)
+            return *hs;
+    }
+    Hideset *hs = arena_alloc(&ctx->arena, sizeof *hs);
+    hs->name = name;
+    hs->rest = rest;
+    hs->sibling = *list;
+    *list = hs;
+    if (!rest)
+        name_map_put(&ctx->names, name, hs);
+    return hs;
+}
+
+const char *intern_name(PpContext *ctx, const char *name)
+{
+    // Interned names are found through their single member hidesets
+    Hideset **hs = name_map_find(&ctx->names, name);
+    if (hs)
+        return (*hs)->name;
+    return hs_intern(ctx, arena_strdup(&ctx->arena, name), NULL)->name;
+}
+
+static _Bool hs_contains(Hideset *hs, const char *name)
+{
+    for (; hs && (uintptr_t) hs->name >= (uintptr_t) name; hs = hs->rest)
+        if (hs->name == name)
+            return 1;
+    return 0;
+}
+
+Hideset *hs_add(PpContext *ctx, Hideset *hs, const char *name)
+{
+    if (!hs || (uintptr_t) name > (uintptr_t) hs->name)
+        return hs_intern(ctx, name, hs);
+    if (name == hs->name)
+        return hs;
+    return hs_intern(ctx, hs->name, hs_add(ctx, hs->rest, name));
+}
+
+static Hideset *hs_union(PpContext *ctx, Hideset *hs1, Hideset *hs2)
+{
+    for (; hs2; hs2 = hs2->rest)
+        hs1 = hs_add(ctx, hs1, hs2->name);
+    return hs1;
+}
+
+static Hideset *hs_intersect(PpContext *ctx, Hideset *hs1, Hideset *hs2)
+{
+    Hideset *result = NULL;
+    for (; hs1; hs1 = hs1->rest)
+        if (hs_contains(hs2, hs1->name))
+            result = hs_add(ctx, result, hs1->name);
+    return result;
+}
+
+void free_hidesets(PpContext *ctx)
+{
+    // NOTE: they are in the arena of the context
+    name_map_free(&ctx->names);
+}
+
+// Only identifiers (to be expanded) and ) (ending an invocation) ever have
+// their hideset looked at
+static _Bool needs_hideset(Token *token)
+{
+    return token->type == TK_IDENTIFIER || token->type == TK_RIGHT_PAREN;
+}
+
+// Change the whitespace flag of a possibly shared token
+static Token *set_lwhite(Token *token, _Bool lwhite)
+{
+    if (token->flags.lwhite != lwhite) {
+        token = unshare_token(token);
+        token->flags.lwhite = lwhite;
+    }
+    return token;
+}
+
 // Look for a ( token after an arbitrary number of newlines
 static _Bool match_lparen(PpContext *ctx)
 {
-    TokenList list;
-    token_list_init(&list);
-    for (;;) {
-        Token *token = pp_read(ctx);
-        if (token) {
-            token_list_add(&list, token);
-            if (token->type == TK_LEFT_PAREN) {
-                token_list_freeall(&list);
-                return 1;
-            }
-            if (token->type != TK_NEW_LINE)
-                break;
-        } else {
-            break;
-        }
+    // NOTE: starts out empty, so it only allocates if there are newlines
+    TokenList newlines = { 0 };
+    Token *token;
+
+    while ((token = pp_read(ctx)) && token->type == TK_NEW_LINE)
+        token_list_add(&newlines, token);
+
+    if (token && token->type == TK_LEFT_PAREN) {
+        free_token(token);
+        token_list_freeall(&newlines);
+        return 1;
     }
-    token_list_extend(pp_push_list_frame(ctx, NULL), &list);
-    token_list_free(&list);
+
+    // Push back the token following the newlines, then the newlines
+    if (token)
+        pp_unread(ctx, token);
+    while (newlines.n)
+        pp_unread(ctx, token_list_pop(&newlines));
+    token_list_free(&newlines);
     return 0;
 }
 
-// Capture the actual parameters for a function like macro call
-static void capture_actuals(PpContext *ctx, Macro *macro, TokenList actuals[])
+// Start an invocation with storage for the actuals of a macro
+static Invocation *push_invocation(PpContext *ctx, Macro *macro, _Bool lwhite)
 {
+    Invocation **slot = invocation_stack_push(&ctx->invocations);
+    PP_STAT_MAX(ctx, max_invoke, ctx->invocations.n);
+    if (ctx->invocations.n > ctx->invocations_pooled) {
+        *slot = calloc(1, sizeof **slot);
+        actual_list_init(&(*slot)->actuals);
+        ctx->invocations_pooled = ctx->invocations.n;
+    }
+
+    Invocation *inv = *slot;
+    inv->macro = macro;
+    inv->lwhite = lwhite;
+    inv->cur = 0;
+    // Storage of the actuals is kept, and only ever added to
+    while (inv->actuals.n < macro->formals.n) {
+        Actual *actual = actual_list_push(&inv->actuals);
+        token_list_init(&actual->tokens);
+        token_list_init(&actual->expansion);
+    }
+    for (size_t i = 0; i < macro->formals.n; ++i)
+        inv->actuals.arr[i].pre_expand = 0;
+    return inv;
+}
+
+void free_invocations(PpContext *ctx)
+{
+    for (size_t i = 0; i < ctx->invocations_pooled; ++i) {
+        Invocation *inv = ctx->invocations.arr[i];
+        for (size_t j = 0; j < inv->actuals.n; ++j) {
+            token_list_freeall(&inv->actuals.arr[j].tokens);
+            token_list_freeall(&inv->actuals.arr[j].expansion);
+        }
+        actual_list_free(&inv->actuals);
+        free(inv);
+    }
+    invocation_stack_free(&ctx->invocations);
+}
+
+// Free the tokens in a list, keeping its storage
+static void clear_tokens(TokenList *list)
+{
+    for (size_t i = 0; i < list->n; ++i)
+        free_token(list->arr[i]);
+    list->n = 0;
+}
+
+// Capture the actual parameters for a function like macro call, returns the
+// hideset of the closing parenthesis
+static Hideset *capture_actuals(PpContext *ctx, Macro *macro, Actual actuals[])
+{
+    Hideset *hideset;
+
     // Check for closing parenthesis for 0 paramter macro
     if (macro->formals.n == 0) {
         Token *rparen = pp_read(ctx);
         if (!rparen || rparen->type != TK_RIGHT_PAREN)
             pp_err(ctx, "Non-empty actual parameters for 0 parameter macro");
+        hideset = rparen->hideset;
         free_token(rparen);
-        return;
+        return hideset;
     }
 
     // Start of actuals
     size_t actual_cnt = 1;
-    token_list_init(actuals);
     // Start at 1 deep parenthesis
     size_t paren_nest = 1;
     // Was the previous token a newline
@@ -63,14 +208,14 @@ static void capture_actuals(PpContext *ctx, Macro *macro, TokenList actuals[])
         if (!token)
             pp_err(ctx, "Unexpected end of actual parameters");
         if (prev_nl)
-            token->flags.lwhite = 1;
+            token = set_lwhite(token, 1);
 
         switch (token->type) {
         case TK_NEW_LINE:
             // Translate newlines to whitespaces in macro invocations
             prev_nl = 1;
             free_token(token);
-            break;
+            continue;
         case TK_COMMA:
             // Ignore comma in nested parenthesis, or in variadic parameter
             if (paren_nest > 1
@@ -80,7 +225,7 @@ static void capture_actuals(PpContext *ctx, Macro *macro, TokenList actuals[])
             free_token(token);
             if (++actual_cnt > macro->formals.n)
                 pp_err(ctx, "Too many actual parameters");
-            token_list_init(++actuals);
+            ++actuals;
             continue;
         case TK_LEFT_PAREN:
             // Increase nesting level
@@ -91,16 +236,17 @@ static void capture_actuals(PpContext *ctx, Macro *macro, TokenList actuals[])
             if (--paren_nest > 0)
                 break;
             // Outer parenthesis means end of actual parameters
+            hideset = token->hideset;
             free_token(token);
             if (actual_cnt < macro->formals.n)
                 pp_err(ctx, "Too few actual parameters");
-            return;
+            return hideset;
         default:
             // Any other token is added to the list
             break;
         }
 
-        token_list_add(actuals, token);
+        token_list_add(&actuals->tokens, token);
     }
 }
 
@@ -140,74 +286,74 @@ Token *stringize(_Bool lit_lwhite, TokenList *tokens)
         (TokenFlags) { .lwhite = lit_lwhite }, sb_str(&sb));
 }
 
+// Add a list of tokens to an expansion, the first one taking lwhite
+static _Bool add_tokens(TokenList *expansion, TokenList *tokens, _Bool lwhite)
+{
+    for (size_t i = 0; i < tokens->n; ++i) {
+        Token *token = ref_token(tokens->arr[i]);
+        if (i == 0)
+            token = set_lwhite(token, lwhite);
+        token_list_add(expansion, token);
+    }
+    return tokens->n > 0;
+}
+
 // Evaluate a single replacement list entry
-static _Bool expand_replace(PpContext *ctx, Replace *replace,
-    TokenList actuals[], TokenList *expansion)
+static _Bool expand_replace(Replace *replace, Actual actuals[],
+    TokenList *expansion)
 {
     if (replace->type == R_TOKEN) {
-        token_list_add(expansion, dup_token(replace->token));
+        // Replacement list tokens are shared with the macro definition
+        token_list_add(expansion, ref_token(replace->token));
         return 1;
     } else if (replace->type == R_OP_STR) {
         token_list_add(expansion, stringize(replace->token->flags.lwhite,
-            actuals + replace->param_idx));
+            &actuals[replace->param_idx].tokens));
         return 1;
     } else if (replace->type == R_OP_GLU) {
-        _Bool had_tokens = 0;
-        for (size_t i = 0; i < actuals[replace->param_idx].n; ++i) {
-            Token *token = dup_token(actuals[replace->param_idx].arr[i]);
-            if (!had_tokens) {
-                token->flags.lwhite = replace->token->flags.lwhite;
-                had_tokens = 1;
-            }
-            token_list_add(expansion, token);
-        }
-        return had_tokens;
+        return add_tokens(expansion, &actuals[replace->param_idx].tokens,
+            replace->token->flags.lwhite);
     } else {
-        PpContext subctx = { .parent = ctx, .macros = ctx->macros, .frames = NULL };
-        TokenList *input = pp_push_list_frame(&subctx, NULL);
-        for (size_t i = 0; i < actuals[replace->param_idx].n; ++i)
-            token_list_add(input, dup_token(actuals[replace->param_idx].arr[i]));
-        _Bool had_tokens = 0;
-        for (Token *token; (token = pp_next(&subctx)); ) {
-            if (!had_tokens) {
-                token->flags.lwhite = replace->token->flags.lwhite;
-                had_tokens = 1;
-            }
-            token_list_add(expansion, token);
-        }
-        return had_tokens;
+        // Each actual is pre-expanded once per invocation, all uses of the
+        // parameter share the same expansion
+        return add_tokens(expansion, &actuals[replace->param_idx].expansion,
+            replace->token->flags.lwhite);
     }
 }
 
 Token *glue(Token *left, Token *right)
 {
     // Combine the spelling of the two tokens (without whitespaces)
-    StringBuilder sb;
-    sb_init(&sb);
-    sb_addstr(&sb, token_spelling(left));
-    sb_addstr(&sb, token_spelling(right));
-    char *combined = sb_str(&sb);
-    // Re-lex new combined token
-    LexCtx *lex = lex_open_string("glue_tmp", combined);
-    Token *result = lex_next(lex);
-    result->flags.lwhite = left->flags.lwhite;
-    // If there are more tokens, it means glue failed
-    if (lex_next(lex))
-        return NULL;
-    lex_free(lex);
-    free(combined);
+    const char *lspell = token_spelling(left), *rspell = token_spelling(right);
+    size_t llen = strlen(lspell), rlen = strlen(rspell);
+    char buf[64], *combined = buf;
+    if (llen + rlen >= sizeof buf)
+        combined = malloc(llen + rlen + 1);
+    memcpy(combined, lspell, llen);
+    memcpy(combined + llen, rspell, rlen + 1);
+    // Re-lex new combined token, it must be exactly one token
+    Token *result = lex_one(combined);
+    if (result)
+        result->flags.lwhite = left->flags.lwhite;
+    if (combined != buf)
+        free(combined);
     free_token(left);
     free_token(right);
     return result;
 }
 
-// Macro parameter substitution, including ## evaluation
-static void expand_macro(PpContext *ctx, Macro *macro, TokenList actuals[], TokenList *expansion)
+// Macro parameter substitution, including ## evaluation, the expansion is
+// spliced into the pending tokens
+static void expand_macro(PpContext *ctx, Macro *macro, Actual actuals[],
+    Hideset *hideset, _Bool lwhite)
 {
+    TokenList *expansion = &ctx->pending;
+    size_t start = expansion->n;
+
     Replace *replace = macro->replace_list.arr;
     for (size_t i = 0; i < macro->replace_list.n; ++i, ++replace) {
         // Evaluate ## operators left to right
-        if (expand_replace(ctx, replace, actuals, expansion))
+        if (expand_replace(replace, actuals, expansion))
             while (replace->glue_next) {
                 // Make sure the right hand operand actually there
                 assert(++i < macro->replace_list.n);
@@ -218,8 +364,9 @@ static void expand_macro(PpContext *ctx, Macro *macro, TokenList actuals[], Toke
                 // Save the index of where to write the ## result
                 size_t result_idx = expansion->n;
 
-                if (expand_replace(ctx, replace, actuals, expansion)) {
+                if (expand_replace(replace, actuals, expansion)) {
                     // Replace the first right token token with the glue result
+                    PP_STAT(ctx, glues);
                     expansion->arr[result_idx] = glue(left, expansion->arr[result_idx]);
                     if (expansion->arr[result_idx] == NULL)
                         pp_err(ctx, "Token concatenation resulted in more than one token");
@@ -229,6 +376,84 @@ static void expand_macro(PpContext *ctx, Macro *macro, TokenList actuals[], Toke
                 }
             }
     }
+
+    // Add the hideset of the expansion to the new tokens, most of them
+    // share the same hideset, thus the last union is re-used
+    Hideset *prev = NULL, *prev_union = hideset;
+    for (size_t i = start; i < expansion->n; ++i) {
+        Token *token = expansion->arr[i];
+        if (!needs_hideset(token))
+            continue;
+        if (token->hideset != prev) {
+            prev = token->hideset;
+            prev_union = hs_union(ctx, hideset, prev);
+        }
+        if (token->hideset != prev_union) {
+            token = expansion->arr[i] = unshare_token(token);
+            token->hideset = prev_union;
+        }
+    }
+
+    // First token from expansion (or next on the stream if empty) inherits
+    // the identifier's spacing
+    if (expansion->n > start) {
+        expansion->arr[start] = set_lwhite(expansion->arr[start], lwhite);
+        pp_flip_pending(ctx, start);
+    } else {
+        Token *token = pp_read(ctx);
+        if (token)
+            pp_unread(ctx, set_lwhite(token, lwhite));
+    }
+}
+
+
+// Does a list of tokens contain anything that might be expanded?
+static _Bool has_identifier(TokenList *tokens)
+{
+    for (size_t i = 0; i < tokens->n; ++i)
+        if (tokens->arr[i]->type == TK_IDENTIFIER)
+            return 1;
+    return 0;
+}
+
+// Start the pre-expansion of the next actual of the topmost invocation,
+// or substitute the actuals into the macro once all of them are expanded
+static void resume_invocation(PpContext *ctx)
+{
+    Invocation *inv = *invocation_stack_top(&ctx->invocations);
+    Macro *macro = inv->macro;
+    Actual *actuals = inv->actuals.arr;
+
+    for (; inv->cur < macro->formals.n; ++inv->cur) {
+        Actual *actual = actuals + inv->cur;
+        if (!actual->pre_expand)
+            continue;
+        // Actuals without identifiers expand to themselves
+        if (!has_identifier(&actual->tokens)) {
+            for (size_t i = 0; i < actual->tokens.n; ++i)
+                token_list_add(&actual->expansion,
+                    ref_token(actual->tokens.arr[i]));
+            continue;
+        }
+        // Otherwise pp_next expands the actual as an isolated sequence, and
+        // collects the result until it reaches the end of it
+        PP_STAT(ctx, pre_expanded);
+        if (ctx->profile)
+            ++prof_entry(ctx, macro)->pre_expanded;
+        pp_push_isolated(ctx);
+        for (size_t i = actual->tokens.n; i-- > 0; )
+            pp_unread(ctx, ref_token(actual->tokens.arr[i]));
+        return;
+    }
+
+    if (ctx->profile)
+        prof_begin(ctx, macro, inv->start);
+    expand_macro(ctx, macro, actuals, inv->hideset, inv->lwhite);
+    for (size_t i = 0; i < macro->formals.n; ++i) {
+        clear_tokens(&actuals[i].tokens);
+        clear_tokens(&actuals[i].expansion);
+    }
+    --ctx->invocations.n;
 }
 
 static _Bool try_expand(PpContext *ctx, Token *identifier, Macro *macro)
@@ -238,57 +463,122 @@ static _Bool try_expand(PpContext *ctx, Token *identifier, Macro *macro)
         if (!match_lparen(ctx))
             return 0;
         // Capture the actuals
-        TokenList *actuals = calloc(macro->formals.n, sizeof *actuals);
-        capture_actuals(ctx, macro, actuals);
-        // Expand macro
-        expand_macro(ctx, macro, actuals, pp_push_list_frame(ctx, macro));
-        // Free actuals
-        for (size_t i = 0; i < macro->formals.n; ++i)
-            token_list_freeall(actuals + i);
-        free(actuals);
+        Invocation *inv = push_invocation(ctx, macro,
+            identifier->flags.lwhite);
+        if (ctx->profile)
+            inv->start = wall_time();
+        Hideset *rparen_hs = capture_actuals(ctx, macro, inv->actuals.arr);
+        // Use the memoized expansion if there's one
+        TokenList *memoized = memo_find(ctx, identifier, macro,
+            inv->actuals.arr, rparen_hs);
+        if (memoized) {
+            for (size_t i = 0; i < macro->formals.n; ++i)
+                clear_tokens(&inv->actuals.arr[i].tokens);
+            --ctx->invocations.n;
+            ctx->replay = memoized;
+            ctx->replay_pos = 0;
+            ctx->replay_lwhite = identifier->flags.lwhite;
+            if (ctx->profile) {
+                MacroProfile *profile = prof_entry(ctx, macro);
+                ++profile->invocations;
+                profile->tokens += memoized->n;
+            }
+            PP_STAT(ctx, exp_function);
+            return 1;
+        }
+        // Expansion hideset is HS(name) & HS(rparen) | { name }
+        inv->hideset = hs_add(ctx,
+            hs_intersect(ctx, identifier->hideset, rparen_hs), macro->ident);
+        // Find the actuals that have to be pre-expanded
+        for (size_t i = 0; i < macro->replace_list.n; ++i) {
+            Replace *replace = macro->replace_list.arr + i;
+            if (replace->type == R_PARAM)
+                inv->actuals.arr[replace->param_idx].pre_expand = 1;
+        }
+        PP_STAT(ctx, exp_function);
+        resume_invocation(ctx);
     } else {
-        expand_macro(ctx, macro, NULL, pp_push_list_frame(ctx, macro));
+        // Expansion hideset is HS(name) | { name }
+        PP_STAT(ctx, exp_object);
+        if (ctx->profile)
+            prof_begin(ctx, macro, wall_time());
+        expand_macro(ctx, macro, NULL,
+            hs_add(ctx, identifier->hideset, macro->ident),
+            identifier->flags.lwhite);
     }
-
-    // This macro can't expand again until the expansion frame is dropped
-    macro->enabled = 0;
-
-    // First token from expansion (or next on the stream if empty) inherits
-    // the identifier's spacing
-    Token *token = pp_read(ctx);
-    if (token) {
-        token->flags.lwhite = identifier->flags.lwhite;
-        token_list_add(pp_push_list_frame(ctx, NULL), token);
-    }
-
     return 1;
 }
 
 Token *pp_next(PpContext *ctx)
 {
+    // Invocations started before this call collect tokens for someone else
+    size_t base = ctx->invocations.n;
     Predef *predef;
     Macro *macro;
 
-    for (Token *token;; free_token(token)) {
-        token = pp_read(ctx);
-        if (token && token->type == TK_IDENTIFIER) {
+    ctx->file_events.n = 0;
+    for (;;) {
+        // Memoized expansions were already rescanned
+        if (ctx->replay) {
+            Token *token = ref_token(ctx->replay->arr[ctx->replay_pos]);
+            if (!ctx->replay_pos)
+                token = set_lwhite(token, ctx->replay_lwhite);
+            if (++ctx->replay_pos == ctx->replay->n)
+                ctx->replay = NULL;
+            PP_STAT(ctx, emitted);
+            return token;
+        }
+        // Reached the end of an expansion being memoized without reading
+        // past it
+        if (ctx->memo && ctx->pending.n
+                && *token_list_top(&ctx->pending) == ctx->memo->end) {
+            --ctx->pending.n;
+            memo_end(ctx, 1);
+        }
+
+        Token *token = pp_read(ctx);
+        if (!token) {
+            // Reached the end of an actual being pre-expanded
+            if (ctx->invocations.n > base) {
+                pp_pop_isolated(ctx);
+                ++(*invocation_stack_top(&ctx->invocations))->cur;
+                resume_invocation(ctx);
+                continue;
+            }
+            return NULL;
+        }
+
+        if (token->type == TK_IDENTIFIER) {
             // Always expand pre-defined macro
             if ((predef = find_predef(token))) {
+                PP_STAT(ctx, exp_predef);
+                // NOTE: these depend on where they're expanded
+                if (ctx->memo)
+                    ctx->memo->failed = 1;
                 predef->handle(ctx);
+                free_token(token);
                 continue;
             }
-            // Try expanding macro if token is available for expansion
-            if (!token->flags.no_expand && (macro = find_macro(ctx, token))) {
-                if (macro->enabled) {
-                    // Try expanding macro
-                    if (try_expand(ctx, token, macro))
-                        continue;
-                } else {
-                    // Mark the token unavailable for expansion in the future
-                    token->flags.no_expand = 1;
-                }
+            // Try expanding macro unless its name is in the token's hideset
+            if ((macro = find_macro(ctx, token))
+                    && !hs_contains(token->hideset, macro->ident)
+                    && try_expand(ctx, token, macro)) {
+                free_token(token);
+                continue;
             }
         }
+
+        // Collect the tokens of an actual being pre-expanded
+        if (ctx->invocations.n > base) {
+            Invocation *inv = *invocation_stack_top(&ctx->invocations);
+            token_list_add(&inv->actuals.arr[inv->cur].expansion, token);
+            ++ctx->prof_tokens;
+            continue;
+        }
+        if (ctx->memo)
+            token_list_add(&ctx->memo->tokens, ref_token(token));
+        ++ctx->prof_tokens;
+        PP_STAT(ctx, emitted);
         return token;
     }
 }
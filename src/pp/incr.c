@@ -0,0 +1,233 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//
+// Pre-processor: incremental re-runs over an edited main file
+//
+// While the main file is written, the state of the pre-processor is saved at
+// the end of lines of the main file where nothing is in flight (no pending
+// tokens, invocations or memoized expansions): after every top-level
+// #include, and every CHECKPOINT_TOKENS tokens. A checkpoint keeps the lexer
+// position, a copy of the slots of the macro table, the conditional stack,
+// the number of files read and the output written so far.
+//
+// Writing the main file again after an edit restores the last checkpoint
+// before the first changed byte, that no changed header was read before, and
+// only pre-processes the rest. Macros aren't freed by #undef in this mode,
+// checkpoints may still see them, the ones defined after the restored
+// checkpoint are freed then instead.
+//
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <vec.h>
+#include <hash.h>
+#include <pool.h>
+#include <arena.h>
+#include <lex/token.h>
+#include <lex/lex.h>
+#include "pp.h"
+#include "def.h"
+
+// Tokens of the main file between checkpoints, besides #include
+#define CHECKPOINT_TOKENS 4096
+
+static void free_checkpoint(Checkpoint *cp)
+{
+    if (!cp->shared)
+        free(cp->macros);
+    cond_list_free(&cp->conds);
+    free(cp->out_path);
+}
+
+// Record the versions of the files read since the last checkpoint
+static void stat_deps(PpContext *ctx)
+{
+    Incremental *incr = ctx->incr;
+    for (size_t i = incr->stats.n; i < ctx->deps.n; ++i) {
+        struct stat st;
+        DepStat ds = { 0 };
+        if (!fstatat(ctx->dirfd, ctx->deps.arr[i].path, &st, 0))
+            ds = (DepStat) { st.st_dev, st.st_ino, st.st_size, st.st_mtim };
+        dep_stat_list_add(&incr->stats, ds);
+    }
+}
+
+// Index of the first file read that changed since, or the number of files
+static size_t first_changed_dep(PpContext *ctx)
+{
+    Incremental *incr = ctx->incr;
+    for (size_t i = 0; i < incr->stats.n; ++i) {
+        struct stat st;
+        DepStat ds = { 0 }, *old = incr->stats.arr + i;
+        if (!fstatat(ctx->dirfd, ctx->deps.arr[i].path, &st, 0))
+            ds = (DepStat) { st.st_dev, st.st_ino, st.st_size, st.st_mtim };
+        if (ds.dev != old->dev || ds.ino != old->ino || ds.size != old->size
+                || ds.mtime.tv_sec != old->mtime.tv_sec
+                || ds.mtime.tv_nsec != old->mtime.tv_nsec)
+            return i;
+    }
+    return incr->stats.n;
+}
+
+static Checkpoint *take_checkpoint(PpContext *ctx, size_t out_len)
+{
+    Incremental *incr = ctx->incr;
+    Frame *frame = ctx->frames.arr;
+    // NOTE: the last one moves as this one is added
+    size_t last = incr->checkpoints.n - 1;
+    Checkpoint *cp = checkpoint_list_push(&incr->checkpoints);
+    memset(cp, 0, sizeof *cp);
+
+    lex_tell(frame->lex, &cp->pos);
+    cp->tokens = frame->tokens;
+    // The macro table is only copied if it changed since the last one
+    cp->macro_gen = ctx->macro_gen;
+    cp->nmacros = ctx->macros.n;
+    cp->macros_size = ctx->macros.size;
+    if (cp != incr->checkpoints.arr
+            && incr->checkpoints.arr[last].macro_gen == ctx->macro_gen) {
+        cp->macros = incr->checkpoints.arr[last].macros;
+        cp->shared = 1;
+    } else if (ctx->macros.size) {
+        size_t size = ctx->macros.size * sizeof *ctx->macros.arr;
+        cp->macros = memcpy(malloc(size), ctx->macros.arr, size);
+    }
+    cp->defined = incr->defined.n;
+    cond_list_init(&cp->conds);
+    cond_list_addall(&cp->conds, frame->conds.arr, frame->conds.n);
+    stat_deps(ctx);
+    cp->deps = ctx->deps.n;
+    cp->out_len = out_len;
+    return cp;
+}
+
+Checkpoint *incr_checkpoint(PpContext *ctx, size_t out_len)
+{
+    // Nothing but the main file may be in flight
+    if (ctx->frames.n != 1 || ctx->pending.n || ctx->invocations.n
+            || ctx->replay || ctx->memo || ctx->prof_frames.n)
+        return NULL;
+    Checkpoint *last = checkpoint_list_top(&ctx->incr->checkpoints);
+    if (ctx->deps.n == last->deps
+            && ctx->frames.arr->tokens - last->tokens < CHECKPOINT_TOKENS)
+        return NULL;
+    return take_checkpoint(ctx, out_len);
+}
+
+// Go back to a checkpoint, with the main file replaced by the new contents
+static void restore_checkpoint(PpContext *ctx, size_t index)
+{
+    Incremental *incr = ctx->incr;
+    Checkpoint *cp = incr->checkpoints.arr + index;
+
+    // Free the checkpoints after it, and the macros defined after it
+    for (size_t i = index + 1; i < incr->checkpoints.n; ++i)
+        free_checkpoint(incr->checkpoints.arr + i);
+    incr->checkpoints.n = index + 1;
+    macro_map_free(&ctx->macros);
+    for (size_t i = cp->defined; i < incr->defined.n; ++i)
+        free_macro(ctx, incr->defined.arr[i]);
+    incr->defined.n = cp->defined;
+
+    ctx->macros.n = cp->nmacros;
+    ctx->macros.size = cp->macros_size;
+    ctx->macros.arr = NULL;
+    if (cp->macros_size) {
+        size_t size = cp->macros_size * sizeof *ctx->macros.arr;
+        ctx->macros.arr = memcpy(malloc(size), cp->macros, size);
+    }
+    ctx->macro_gen = cp->macro_gen;
+
+    // NOTE: files read after it stay in dep_paths, pp_add_dep lists them
+    // again with the same path if they are read again
+    ctx->deps.n = cp->deps;
+    if (incr->stats.n > cp->deps)
+        incr->stats.n = cp->deps;
+
+    pp_push_string(ctx, incr->path, incr->source);
+    Frame *frame = ctx->frames.arr;
+    lex_seek(frame->lex, &cp->pos);
+    frame->tokens = cp->tokens;
+    cond_list_addall(&frame->conds, cp->conds.arr, cp->conds.n);
+}
+
+Checkpoint *incr_begin(PpContext *ctx, const char *path, const char *str)
+{
+    Incremental *incr = ctx->incr;
+    size_t len = strlen(str);
+
+    if (!incr) {
+        if (ctx->frames.n)
+            pp_err(ctx, "Incremental output must start from the main file");
+        incr = ctx->incr = calloc(1, sizeof *incr);
+        checkpoint_list_init(&incr->checkpoints);
+        macro_list_init(&incr->defined);
+        dep_stat_list_init(&incr->stats);
+        sb_init(&incr->output);
+        incr->path = strdup(path);
+        incr->source = strdup(str);
+        incr->len = len;
+        pp_push_string(ctx, incr->path, incr->source);
+        return take_checkpoint(ctx, 0);
+    }
+
+    // First byte that differs, counting the terminator
+    size_t diff = 0;
+    while (diff < len && diff < incr->len && str[diff] == incr->source[diff])
+        ++diff;
+    size_t changed = first_changed_dep(ctx);
+    // Results of #if expressions are kept by location, they may be stale in
+    // a changed file
+    if (changed < incr->stats.n) {
+        free_if_memos(ctx);
+        ctx->if_memos = NULL;
+    }
+    if (strcmp(path, incr->path))
+        diff = 0;
+
+    // Tokens left from the last run go with its frames
+    for (size_t i = 0; i < ctx->pending.n; ++i)
+        if (ctx->pending.arr[i])
+            free_token(ctx->pending.arr[i]);
+    ctx->pending.n = 0;
+    while (ctx->frames.n)
+        drop_frame(ctx);
+    free(incr->path);
+    free(incr->source);
+    incr->path = strdup(path);
+    incr->source = strdup(str);
+    incr->len = len;
+
+    // The lexer read up to pos.offset, the first checkpoint always fits
+    size_t index = incr->checkpoints.n - 1;
+    while (index && (incr->checkpoints.arr[index].pos.offset > diff
+            || incr->checkpoints.arr[index].deps > changed))
+        --index;
+    restore_checkpoint(ctx, index);
+    return incr->checkpoints.arr + index;
+}
+
+void incr_free(PpContext *ctx)
+{
+    Incremental *incr = ctx->incr;
+    if (!incr)
+        return;
+    for (size_t i = 0; i < incr->checkpoints.n; ++i)
+        free_checkpoint(incr->checkpoints.arr + i);
+    checkpoint_list_free(&incr->checkpoints);
+    // Every macro is in here, including the ones still defined
+    for (size_t i = 0; i < incr->defined.n; ++i)
+        free_macro(ctx, incr->defined.arr[i]);
+    macro_list_free(&incr->defined);
+    macro_map_free(&ctx->macros);
+    macro_map_init(&ctx->macros);
+    dep_stat_list_free(&incr->stats);
+    sb_free(&incr->output);
+    free(incr->path);
+    free(incr->source);
+    free(incr);
+    ctx->incr = NULL;
+}
@@ -0,0 +1,206 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//
+// Pre-processor: memoized function-like macro invocations
+//
+// The expansion of an invocation is recorded as pp_next returns it, from the
+// tokens of the actuals being captured until a marker placed right after
+// the expansion is reached. If anything reads past the marker (e.g. a macro
+// at the end of the expansion taking its actuals from the rest of the
+// input), the expansion isn't memoized. Only invocations at the top level,
+// with none of their tokens coming from other expansions are memoized, so
+// the same macro and actuals always expand the same way, as long as the
+// macros looked up are the same.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vec.h>
+#include <hash.h>
+#include <pool.h>
+#include <arena.h>
+#include <lex/token.h>
+#include <lex/lex.h>
+#include "pp.h"
+#include "def.h"
+
+void pp_memo_enable(PpContext *ctx, size_t budget)
+{
+    ctx->memo_budget = budget;
+}
+
+// Spell the actuals of an invocation, returns NULL if any of the tokens
+// has a hideset
+static char *spell_actuals(Macro *macro, Actual actuals[])
+{
+    StringBuilder sb;
+    sb_init(&sb);
+
+    for (size_t i = 0; i < macro->formals.n; ++i) {
+        TokenList *tokens = &actuals[i].tokens;
+        for (size_t j = 0; j < tokens->n; ++j) {
+            if (tokens->arr[j]->hideset) {
+                sb_free(&sb);
+                return NULL;
+            }
+            // NOTE: spacing matters for # and the output
+            if (tokens->arr[j]->flags.lwhite)
+                sb_add(&sb, ' ');
+            sb_addstr(&sb, token_spelling(tokens->arr[j]));
+        }
+        // Newlines can't be part of a spelling
+        sb_add(&sb, '\n');
+    }
+    return sb_str(&sb);
+}
+
+static size_t hash_memo(size_t serial, const char *actuals)
+{
+    // FNV-1a
+    size_t hash = 14695981039346656037UL ^ serial;
+    for (; *actuals; ++actuals)
+        hash = (hash ^ (unsigned char) *actuals) * 1099511628211UL;
+    return hash;
+}
+
+static size_t memo_size(MacroMemo *memo)
+{
+    size_t size = sizeof *memo + strlen(memo->actuals) + 1
+        + memo->tokens.n * sizeof (Token *);
+    for (size_t i = 0; i < memo->refs.n; ++i)
+        size += sizeof (MacroRef) + strlen(memo->refs.arr[i].name) + 1;
+    return size;
+}
+
+static void free_memo(MacroMemo *memo)
+{
+    free(memo->actuals);
+    clear_macro_refs(&memo->refs);
+    macro_ref_list_free(&memo->refs);
+    token_list_freeall(&memo->tokens);
+    free(memo);
+}
+
+TokenList *memo_find(PpContext *ctx, Token *identifier, Macro *macro,
+                     Actual actuals[], Hideset *rparen_hs)
+{
+    // Nested invocations, and tokens from other expansions have hidesets
+    // that change the result, so does anything after an isolated sequence
+    if (!ctx->memo_budget || ctx->memo || ctx->lookups || ctx->isolated
+            || ctx->invocations.n > 1 || identifier->hideset || rparen_hs)
+        return NULL;
+    char *spelling = spell_actuals(macro, actuals);
+    if (!spelling)
+        return NULL;
+
+    if (!ctx->memos)
+        ctx->memos = calloc(MEMO_BUCKETS, sizeof *ctx->memos);
+    size_t hash = hash_memo(macro->serial, spelling);
+    for (MacroMemo **memo = ctx->memos + hash % MEMO_BUCKETS; *memo;
+            memo = &(*memo)->next) {
+        if ((*memo)->hash != hash || (*memo)->serial != macro->serial
+                || strcmp((*memo)->actuals, spelling))
+            continue;
+        if (macro_refs_valid(ctx, &(*memo)->refs)) {
+            ++macro->memo_hits;
+            free(spelling);
+            return &(*memo)->tokens;
+        }
+        // A macro it depends on changed, record it again
+        MacroMemo *stale = *memo;
+        *memo = stale->next;
+        ctx->memo_bytes -= memo_size(stale);
+        free_memo(stale);
+        break;
+    }
+
+    // Record the expansion, the marker goes before the actuals are expanded
+    MacroMemo *memo = calloc(1, sizeof *memo);
+    memo->serial = macro->serial;
+    memo->actuals = spelling;
+    memo->hash = hash;
+    macro_ref_list_init(&memo->refs);
+    token_list_init(&memo->tokens);
+    memo->end = create_token(TK_OTHER, TOKEN_NOFLAGS, NULL);
+    pp_unread(ctx, memo->end);
+    ctx->memo = memo;
+    ctx->lookups = &memo->refs;
+    ++macro->memo_misses;
+    return NULL;
+}
+
+void memo_end(PpContext *ctx, _Bool clean)
+{
+    MacroMemo *memo = ctx->memo;
+    ctx->memo = NULL;
+    ctx->lookups = NULL;
+    free_token(memo->end);
+    memo->end = NULL;
+
+    // Empty expansions are left out, the token after them takes their spacing
+    size_t size = memo_size(memo);
+    if (!clean || memo->failed || !memo->tokens.n
+            || ctx->memo_bytes + size > ctx->memo_budget) {
+        free_memo(memo);
+        return;
+    }
+    MacroMemo **bucket = ctx->memos + memo->hash % MEMO_BUCKETS;
+    memo->next = *bucket;
+    *bucket = memo;
+    ctx->memo_bytes += size;
+}
+
+void free_memos(PpContext *ctx)
+{
+    // NOTE: the marker of the one being recorded is freed with the pending
+    // tokens
+    if (ctx->memo)
+        free_memo(ctx->memo);
+    if (!ctx->memos)
+        return;
+    for (size_t i = 0; i < MEMO_BUCKETS; ++i)
+        for (MacroMemo *memo = ctx->memos[i]; memo; ) {
+            MacroMemo *next = memo->next;
+            free_memo(memo);
+            memo = next;
+        }
+    free(ctx->memos);
+}
+
+static int cmp_memo_hits(const void *a, const void *b)
+{
+    size_t ha = (*(Macro *const *) a)->memo_hits;
+    size_t hb = (*(Macro *const *) b)->memo_hits;
+    return (ha < hb) - (ha > hb);
+}
+
+void pp_print_memo(PpContext *ctx, FILE *fp, size_t top)
+{
+    // Macros still defined that were invoked with memoization
+    size_t n = 0;
+    for (size_t i = 0; i < ctx->macros.size; ++i)
+        if (ctx->macros.arr[i].hash)
+            for (Macro *m = ctx->macros.arr[i].value; m; m = m->shadowed)
+                n += m->memo_hits + m->memo_misses > 0;
+    Macro **macros = calloc(n + 1, sizeof *macros);
+    n = 0;
+    for (size_t i = 0; i < ctx->macros.size; ++i)
+        if (ctx->macros.arr[i].hash)
+            for (Macro *m = ctx->macros.arr[i].value; m; m = m->shadowed)
+                if (m->memo_hits + m->memo_misses)
+                    macros[n++] = m;
+    qsort(macros, n, sizeof *macros, cmp_memo_hits);
+
+    if (top > n)
+        top = n;
+    fprintf(fp, "Memoized invocations (%zu bytes), top %zu macros by hits:\n",
+        ctx->memo_bytes, top);
+    for (size_t i = 0; i < top; ++i) {
+        size_t total = macros[i]->memo_hits + macros[i]->memo_misses;
+        fprintf(fp, "%10zu hits %10zu misses %6.1f%% %s\n",
+            macros[i]->memo_hits, macros[i]->memo_misses,
+            100.0 * macros[i]->memo_hits / total, macros[i]->name->data);
+    }
+    free(macros);
+}
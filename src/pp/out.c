@@ -0,0 +1,429 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//
+// Pre-processor output: text (-E) and dependencies (-M)
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vec.h>
+#include <hash.h>
+#include <pool.h>
+#include <arena.h>
+#include <lex/token.h>
+#include <lex/lex.h>
+#include "pp.h"
+#include "def.h"
+
+// Size of the output buffer
+#define OUT_BUFSIZE 65536
+
+// Longest line jump reproduced with blank lines instead of a line marker
+#define OUT_MAX_BLANK 8
+
+typedef struct {
+    // Output file descriptor, and errno of the first write that failed (the
+    // rest of the output is dropped)
+    int fd, error;
+    // Arena of the pre-processor context
+    Arena *arena;
+
+    // Source location of the current output line (path is NULL or points
+    // to path_buf)
+    char *path, *path_buf;
+    size_t path_size, line;
+    // Was anything written to the current output line
+    _Bool dirty;
+
+    // Copy of everything written (if not NULL)
+    StringBuilder *copy;
+
+    // Output buffer
+    size_t len;
+    char buf[OUT_BUFSIZE];
+} OutCtx;
+
+//
+// Write a vector of buffers completely
+//
+static void out_writev(OutCtx *out, struct iovec *iov, int cnt)
+{
+    while (cnt && !out->error) {
+        ssize_t n = writev(out->fd, iov, cnt);
+        if (n < 0) {
+            if (errno != EINTR)
+                out->error = errno;
+            continue;
+        }
+        // Skip over the parts that were written
+        for (; cnt && (size_t) n >= iov->iov_len; ++iov, --cnt)
+            n -= iov->iov_len;
+        if (cnt) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static void out_flush(OutCtx *out)
+{
+    if (out->copy)
+        sb_addall(out->copy, out->buf, out->len);
+    struct iovec iov = { out->buf, out->len };
+    out_writev(out, &iov, 1);
+    out->len = 0;
+}
+
+void out_flush_buffer(void *out)
+{
+    out_flush(out);
+}
+
+static void out_write(OutCtx *out, const char *s, size_t n)
+{
+    if (out->len + n <= OUT_BUFSIZE) {
+        memcpy(out->buf + out->len, s, n);
+        out->len += n;
+        return;
+    }
+    if (out->copy) {
+        sb_addall(out->copy, out->buf, out->len);
+        sb_addall(out->copy, s, n);
+    }
+    // Send the buffer and the data that didn't fit in one go
+    struct iovec iov[2] = {
+        { out->buf, out->len },
+        { (char *) s, n },
+    };
+    out_writev(out, iov, 2);
+    out->len = 0;
+}
+
+static void out_putc(OutCtx *out, char c)
+{
+    if (out->len == OUT_BUFSIZE)
+        out_flush(out);
+    out->buf[out->len++] = c;
+}
+
+static void out_puts(OutCtx *out, const char *s)
+{
+    out_write(out, s, strlen(s));
+}
+
+//
+// Write a line marker for the current location
+//
+static void out_marker(OutCtx *out, const char *flag)
+{
+    char num[32];
+    snprintf(num, sizeof num, "# %zu \"", out->line);
+    out_puts(out, num);
+    for (const char *s = out->path; *s; ++s) {
+        if (*s == '\\' || *s == '"')
+            out_putc(out, '\\');
+        out_putc(out, *s);
+    }
+    out_putc(out, '"');
+    out_puts(out, flag);
+    out_putc(out, '\n');
+}
+
+static void out_set_path(OutCtx *out, const char *path)
+{
+    size_t len = strlen(path) + 1;
+    if (len > out->path_size) {
+        out->path_size = len * 2;
+        out->path_buf = arena_alloc(out->arena, out->path_size);
+    }
+    out->path = memcpy(out->path_buf, path, len);
+}
+
+//
+// Move the output to the source location of a token starting a line
+//
+static void out_sync(OutCtx *out, PpLocation *loc)
+{
+    if (!out->path || strcmp(out->path, loc->path)) {
+        out_set_path(out, loc->path);
+        out->line = loc->line;
+        out_marker(out, "");
+    } else if (loc->line > out->line
+            && loc->line - out->line <= OUT_MAX_BLANK) {
+        while (out->line < loc->line) {
+            out_putc(out, '\n');
+            ++out->line;
+        }
+    } else if (loc->line != out->line) {
+        out->line = loc->line;
+        out_marker(out, "");
+    }
+}
+
+//
+// Write the line markers of the files entered (flag 1) and returned to (flag
+// 2) before the next token
+//
+static void out_file_events(OutCtx *out, FileEventList *events)
+{
+    for (size_t i = 0; i < events->n; ++i) {
+        FileEvent *event = events->arr + i;
+        // End the line of a token read ahead of it
+        if (out->dirty) {
+            out_putc(out, '\n');
+            out->dirty = 0;
+        }
+        // The output starts with an #include, mark the file it's in first
+        if (!out->path && event->enter) {
+            out_set_path(out, event->from);
+            out->line = event->from_line;
+            out_marker(out, "");
+        }
+        out_set_path(out, event->path);
+        out->line = event->line;
+        out_marker(out, event->enter ? " 1" : " 2");
+    }
+    events->n = 0;
+}
+
+// Save the output state at a checkpoint of the main file
+static void out_checkpoint(PpContext *ctx, OutCtx *out)
+{
+    Checkpoint *cp = incr_checkpoint(ctx, out->copy->n + out->len);
+    if (!cp)
+        return;
+    cp->out_path = out->path ? strdup(out->path) : NULL;
+    cp->out_line = out->line;
+    cp->out_dirty = out->dirty;
+}
+
+// Write the tokens of a context, or of its pipe (if not NULL)
+static void out_tokens(PpContext *ctx, PpPipe *pipe, OutCtx *out)
+{
+    FileEventList *events = pipe ? pipe_file_events(pipe) : &ctx->file_events;
+    Token *token;
+    PpLocation loc;
+
+    for (;;) {
+        token = pipe ? pp_pipe_next(pipe) : pp_next(ctx);
+        out_file_events(out, events);
+        if (!token)
+            break;
+        if (token->type == TK_NEW_LINE) {
+            // Blank lines are reproduced by out_sync from the next location
+            if (out->dirty) {
+                out_putc(out, '\n');
+                ++out->line;
+                out->dirty = 0;
+            }
+            free_token(token);
+            if (!pipe && ctx->incr)
+                out_checkpoint(ctx, out);
+            continue;
+        }
+        if (!out->dirty && (pipe ? pp_pipe_location(pipe, &loc)
+                : pp_location(ctx, &loc)))
+            out_sync(out, &loc);
+        if (token->flags.lwhite)
+            out_putc(out, ' ');
+        out_puts(out, token_spelling(token));
+        out->dirty = 1;
+        free_token(token);
+    }
+    if (out->dirty)
+        out_putc(out, '\n');
+
+    out_flush(out);
+}
+
+// Returns 0, or -1 with errno set if a write failed
+static int out_result(OutCtx *out)
+{
+    if (!out->error)
+        return 0;
+    errno = out->error;
+    return -1;
+}
+
+int pp_write(PpContext *ctx, int fd)
+{
+    // NOTE: in the arena, so it goes away with the context even if an error
+    // ends the output
+    OutCtx *out = arena_alloc(&ctx->arena, sizeof *out);
+    out->fd = fd;
+    out->arena = &ctx->arena;
+    ctx->out = out;
+    out_tokens(ctx, NULL, out);
+    ctx->out = NULL;
+    return out_result(out);
+}
+
+int pp_write_pipe(PpPipe *pipe, int fd)
+{
+    // NOTE: the arena of the context belongs to the other thread
+    Arena *arena = pp_pipe_arena(pipe);
+    OutCtx *out = arena_alloc(arena, sizeof *out);
+    out->fd = fd;
+    out->arena = arena;
+    pipe_set_out(pipe, out);
+    out_tokens(NULL, pipe, out);
+    pipe_set_out(pipe, NULL);
+    return out_result(out);
+}
+
+size_t pp_write_incremental(PpContext *ctx, const char *path, const char *str,
+                            int fd)
+{
+    Checkpoint *cp = incr_begin(ctx, path, str);
+    Incremental *incr = ctx->incr;
+    OutCtx *out = incr->out;
+    if (!out) {
+        out = incr->out = arena_alloc(&ctx->arena, sizeof *out);
+        out->arena = &ctx->arena;
+        out->copy = &incr->output;
+    }
+    out->fd = fd;
+    out->error = 0;
+
+    // Output up to the checkpoint is the same as last time
+    incr->output.n = cp->out_len;
+    struct iovec iov = { incr->output.arr, cp->out_len };
+    out_writev(out, &iov, 1);
+    out->path = NULL;
+    if (cp->out_path)
+        out_set_path(out, cp->out_path);
+    out->line = cp->out_line;
+    out->dirty = cp->out_dirty;
+    out->len = 0;
+    // NOTE: cp moves as checkpoints are added
+    size_t resumed = cp == incr->checkpoints.arr ? 0 : cp->pos.offset;
+
+    ctx->out = out;
+    out_tokens(ctx, NULL, out);
+    ctx->out = NULL;
+    return out_result(out) < 0 ? (size_t) -1 : resumed;
+}
+
+// Write a path escaped for Make
+static size_t write_dep(FILE *fp, const char *path)
+{
+    size_t len = 0;
+    for (; *path; ++path, ++len)
+        switch (*path) {
+        case ' ':
+        case '#':
+            fputc('\\', fp);
+            fputc(*path, fp);
+            ++len;
+            break;
+        case '$':
+            fputs("$$", fp);
+            ++len;
+            break;
+        default:
+            fputc(*path, fp);
+        }
+    return len;
+}
+
+// Longest line of dependency output before wrapping
+#define DEP_COLUMNS 75
+
+void pp_write_deps(PpContext *ctx, FILE *fp, const char *target, _Bool system)
+{
+    size_t col = write_dep(fp, target) + 1;
+    fputc(':', fp);
+
+    for (size_t i = 0; i < ctx->deps.n; ++i) {
+        Dep *dep = ctx->deps.arr + i;
+        if (dep->system && !system)
+            continue;
+        if (col + strlen(dep->path) + 1 > DEP_COLUMNS) {
+            fputs(" \\\n", fp);
+            col = 0;
+        }
+        fputc(' ', fp);
+        col += write_dep(fp, dep->path) + 1;
+    }
+    fputc('\n', fp);
+}
+
+// Cost of a header over all of its inclusions
+typedef struct {
+    const char  *path;
+    size_t      count;
+    double      time, self;
+    size_t      tokens, macros;
+} HeaderCost;
+
+static int cmp_header_cost(const void *a, const void *b)
+{
+    double ta = ((const HeaderCost *) a)->time;
+    double tb = ((const HeaderCost *) b)->time;
+    return (ta < tb) - (ta > tb);
+}
+
+void pp_print_includes(PpContext *ctx, FILE *fp, size_t top)
+{
+    Include *includes = ctx->includes.arr;
+    size_t n = ctx->includes.n;
+    if (!n)
+        return;
+
+    // Exclusive time is what's left after the direct includes, the last file
+    // opened at each depth is the parent of the next one below it
+    double *self = malloc(n * sizeof *self);
+    size_t *parents = malloc(n * sizeof *parents);
+    for (size_t i = 0; i < n; ++i) {
+        self[i] = includes[i].time;
+        parents[includes[i].depth] = i;
+        if (includes[i].depth)
+            self[parents[includes[i].depth - 1]] -= includes[i].time;
+    }
+
+    fprintf(fp, "Include tree (inclusive/exclusive ms, tokens, macros):\n");
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t d = 0; d < includes[i].depth; ++d)
+            fputc('.', fp);
+        fprintf(fp, "%s%s %.3f/%.3f ms, %zu tokens, %zu macros\n",
+            includes[i].depth ? " " : "", includes[i].path,
+            includes[i].time * 1e3, self[i] * 1e3,
+            includes[i].tokens, includes[i].macros);
+    }
+
+    // Add up every inclusion of the same header (the main file is left out)
+    HeaderCost *costs = calloc(n, sizeof *costs);
+    size_t ncosts = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (!includes[i].depth)
+            continue;
+        size_t j = 0;
+        while (j < ncosts && strcmp(costs[j].path, includes[i].path))
+            ++j;
+        if (j == ncosts)
+            costs[ncosts++].path = includes[i].path;
+        ++costs[j].count;
+        costs[j].time += includes[i].time;
+        costs[j].self += self[i];
+        costs[j].tokens += includes[i].tokens;
+        costs[j].macros += includes[i].macros;
+    }
+    qsort(costs, ncosts, sizeof *costs, cmp_header_cost);
+
+    if (top > ncosts)
+        top = ncosts;
+    if (top)
+        fprintf(fp, "Top %zu headers by total time:\n", top);
+    for (size_t i = 0; i < top; ++i)
+        fprintf(fp, "%10.3f ms %10.3f ms %8zu tokens %6zu macros %4zux %s\n",
+            costs[i].time * 1e3, costs[i].self * 1e3, costs[i].tokens,
+            costs[i].macros, costs[i].count, costs[i].path);
+
+    free(costs);
+    free(parents);
+    free(self);
+}
@@ -0,0 +1,316 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//
+// Pre-processor: pipelined mode
+//
+// The pre-processor runs on a thread of its own and hands the tokens over to
+// the consumer (the output writer or the parser) in batches, through a ring.
+// The tokens are the same, in the same order, as pp_next returns them. They
+// are unshared before being handed over, as reference counts aren't atomic.
+// Tokens starting a line carry their location along, by the time they're
+// read the lexers have moved on, and so do the files entered and returned to
+// before each token.
+//
+// An error of the pre-processor ends the batches after the tokens read
+// before it, the consumer reports it and gets to the error handler once it
+// reads them all (and flushed the output they made).
+//
+
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vec.h>
+#include <hash.h>
+#include <pool.h>
+#include <arena.h>
+#include <ring.h>
+#include <lex/token.h>
+#include <lex/lex.h>
+#include "pp.h"
+#include "def.h"
+
+// Tokens handed over at once
+#define PIPE_BATCH 512
+
+// Batches the pre-processor can be ahead by
+#define PIPE_BATCHES 8
+
+typedef struct {
+    Token       *token;
+    _Bool       line_start; // Is it the first token of a line?
+    _Bool       has_loc;    // Was a location found for it? (if line_start)
+    PpLocation  loc;
+} PipeToken;
+
+typedef struct {
+    size_t        n;
+    PipeToken     tokens[PIPE_BATCH];
+    // File events of the batch, the ones before tokens[i] end at ends[i], the
+    // ones after the last token (at the end of the input) follow
+    FileEventList events;
+    size_t        ends[PIPE_BATCH];
+} PipeBatch;
+
+RING_GEN(PipeBatch, PIPE_BATCHES, PipeRing, pipe_ring)
+
+struct PpPipe {
+    PipeRing    ring;
+    PpContext   *ctx;
+    pthread_t   thread;
+    _Bool       running;    // Is the thread yet to be joined?
+    // Error output and handler of the context, restored once the thread is
+    // done, errors are printed to err_buf meanwhile
+    FILE        *err_fp;
+    void        (*err_handler)(void *);
+    void        *err_arg;
+    char        *err_buf;
+    size_t      err_len;
+
+    // Pre-processor side: where an error returns to, the batch being filled,
+    // and the copy of the last path of a location
+    jmp_buf     env;
+    PipeBatch   *filling;
+    const char  *path;
+    _Bool       failed;     // Did it end on an error?
+
+    // Consumer side: the batch being read, the location of the last token
+    // starting a line, the file events before it, memory for the consumer,
+    // and the output it's writing (if any)
+    PipeBatch   *batch;
+    size_t      pos;
+    _Bool       has_loc;
+    PpLocation  loc;
+    FileEventList events;
+    Arena       arena;
+    void        *out;
+};
+
+static void pipe_error(void *arg)
+{
+    PpPipe *pipe = arg;
+    longjmp(pipe->env, 1);
+}
+
+static _Bool pipe_location(PpPipe *pipe, PpLocation *loc)
+{
+    if (!pp_location(pipe->ctx, loc))
+        return 0;
+    // Lexers free their path when done, the consumer gets a copy
+    if (!pipe->path || strcmp(pipe->path, loc->path))
+        pipe->path = arena_strdup(&pipe->ctx->arena, loc->path);
+    loc->path = pipe->path;
+    return 1;
+}
+
+// Hand over batches of tokens until the end, or the ring is cancelled
+static void pipe_produce(PpPipe *pipe)
+{
+    _Bool line_start = 1;
+    PipeBatch *batch;
+
+    while ((batch = pipe->filling = pipe_ring_write_slot(&pipe->ring))) {
+        Token *token = NULL;
+        batch->events.n = 0;
+        for (batch->n = 0; batch->n < PIPE_BATCH; ++batch->n) {
+            token = pp_next(pipe->ctx);
+            FileEventList *events = &pipe->ctx->file_events;
+            file_event_list_addall(&batch->events, events->arr, events->n);
+            if (!token)
+                break;
+            batch->ends[batch->n] = batch->events.n;
+            PipeToken *pt = batch->tokens + batch->n;
+            pt->token = unshare_token(token);
+            pt->line_start = line_start && token->type != TK_NEW_LINE;
+            if (pt->line_start)
+                pt->has_loc = pipe_location(pipe, &pt->loc);
+            line_start = token->type == TK_NEW_LINE;
+        }
+        pipe->filling = NULL;
+        pipe_ring_commit(&pipe->ring);
+        if (!token)
+            return;
+    }
+}
+
+static void *pipe_run(void *arg)
+{
+    PpPipe *pipe = arg;
+
+    if (setjmp(pipe->env)) {
+        // Hand over the tokens read before the error
+        pipe->failed = 1;
+        if (pipe->filling)
+            pipe_ring_commit(&pipe->ring);
+    } else {
+        pipe_produce(pipe);
+    }
+    pipe_ring_close(&pipe->ring);
+    return NULL;
+}
+
+PpPipe *pp_pipe_start(PpContext *ctx)
+{
+    // NOTE: the counters of the ring are cache line aligned
+    size_t size = (sizeof (PpPipe) + 63) / 64 * 64;
+    PpPipe *pipe = memset(aligned_alloc(64, size), 0, size);
+    pipe_ring_init(&pipe->ring);
+    for (size_t i = 0; i < PIPE_BATCHES; ++i)
+        file_event_list_init(&pipe->ring.slots[i].events);
+    file_event_list_init(&pipe->events);
+    pipe->ctx = ctx;
+    arena_init(&pipe->arena);
+    pipe->err_fp = ctx->err_fp;
+    pipe->err_handler = ctx->err_handler;
+    pipe->err_arg = ctx->err_arg;
+    // Failing to start only fails this context, the ring is closed for the
+    // producer that never ran
+    FILE *err = open_memstream(&pipe->err_buf, &pipe->err_len);
+    if (!err) {
+        int error = errno;
+        pipe_ring_close(&pipe->ring);
+        pp_pipe_free(pipe);
+        pp_err(ctx, "Can't start the pre-processor thread: %s",
+            strerror(error));
+    }
+    pp_set_err(ctx, err, pipe_error, pipe);
+    ctx->pipe = pipe;
+
+    int error = pthread_create(&pipe->thread, NULL, pipe_run, pipe);
+    if (error) {
+        fclose(err);
+        pp_set_err(ctx, pipe->err_fp, pipe->err_handler, pipe->err_arg);
+        pipe_ring_close(&pipe->ring);
+        pp_pipe_free(pipe);
+        pp_err(ctx, "Can't start the pre-processor thread: %s",
+            strerror(error));
+    }
+    pipe->running = 1;
+    return pipe;
+}
+
+// Wait for the thread to be done, the context is the caller's again
+static void pipe_join(PpPipe *pipe)
+{
+    if (!pipe->running)
+        return;
+    pthread_join(pipe->thread, NULL);
+    pipe->running = 0;
+    fclose(pipe->ctx->err_fp);
+    pp_set_err(pipe->ctx, pipe->err_fp, pipe->err_handler, pipe->err_arg);
+}
+
+// Add the file events of a batch before the token at pos (or after the last
+// one) to those of the consumer
+static void pipe_take_events(PpPipe *pipe, PipeBatch *batch, size_t pos)
+{
+    size_t start = pos ? batch->ends[pos - 1] : 0;
+    size_t end = pos < batch->n ? batch->ends[pos] : batch->events.n;
+    file_event_list_addall(&pipe->events, batch->events.arr + start,
+        end - start);
+}
+
+Token *pp_pipe_next(PpPipe *pipe)
+{
+    pipe->events.n = 0;
+    while (!pipe->batch || pipe->pos == pipe->batch->n) {
+        if (pipe->batch) {
+            pipe_take_events(pipe, pipe->batch, pipe->pos);
+            pipe_ring_release(&pipe->ring);
+        }
+        pipe->pos = 0;
+        if (!(pipe->batch = pipe_ring_read_slot(&pipe->ring))) {
+            pipe_join(pipe);
+            if (pipe->failed) {
+                // The output before the error comes first
+                if (pipe->out)
+                    out_flush_buffer(pipe->out);
+                fflush(stdout);
+                fputs(pipe->err_buf, pipe->err_fp);
+                pp_fail(pipe->ctx);
+            }
+            return NULL;
+        }
+    }
+
+    pipe_take_events(pipe, pipe->batch, pipe->pos);
+    PipeToken *pt = pipe->batch->tokens + pipe->pos++;
+    if (pt->line_start) {
+        pipe->has_loc = pt->has_loc;
+        pipe->loc = pt->loc;
+    }
+    return pt->token;
+}
+
+_Bool pp_pipe_location(PpPipe *pipe, PpLocation *loc)
+{
+    *loc = pipe->loc;
+    return pipe->has_loc;
+}
+
+Arena *pp_pipe_arena(PpPipe *pipe)
+{
+    return &pipe->arena;
+}
+
+void pipe_set_out(PpPipe *pipe, void *out)
+{
+    pipe->out = out;
+}
+
+FileEventList *pipe_file_events(PpPipe *pipe)
+{
+    return &pipe->events;
+}
+
+void __attribute__((noreturn)) pp_pipe_err(PpPipe *pipe, const char *err, ...)
+{
+    PpContext *ctx = pipe->ctx;
+    pipe_ring_cancel(&pipe->ring);
+    pipe_join(pipe);
+
+    if (pipe->out)
+        out_flush_buffer(pipe->out);
+    fflush(stdout);
+    fprintf(ctx->err_fp, "Error: ");
+    if (pipe->has_loc)
+        fprintf(ctx->err_fp, "%s:%zu: ", pipe->loc.path, pipe->loc.line);
+    va_list ap;
+    va_start(ap, err);
+    vfprintf(ctx->err_fp, err, ap);
+    va_end(ap);
+    fputc('\n', ctx->err_fp);
+    pp_fail(ctx);
+}
+
+void pp_pipe_free(PpPipe *pipe)
+{
+    // Stop the pre-processor if the consumer stopped early
+    pipe_ring_cancel(&pipe->ring);
+    pipe_join(pipe);
+
+    // Free the tokens handed over but not read
+    if (pipe->batch) {
+        for (size_t i = pipe->pos; i < pipe->batch->n; ++i)
+            free_token(pipe->batch->tokens[i].token);
+        pipe_ring_release(&pipe->ring);
+    }
+    PipeBatch *batch;
+    while ((batch = pipe_ring_read_slot(&pipe->ring))) {
+        for (size_t i = 0; i < batch->n; ++i)
+            free_token(batch->tokens[i].token);
+        pipe_ring_release(&pipe->ring);
+    }
+
+    for (size_t i = 0; i < PIPE_BATCHES; ++i)
+        file_event_list_free(&pipe->ring.slots[i].events);
+    file_event_list_free(&pipe->events);
+    pipe_ring_free(&pipe->ring);
+    arena_free(&pipe->arena);
+    free(pipe->err_buf);
+    pipe->ctx->pipe = NULL;
+    free(pipe);
+}
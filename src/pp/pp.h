@@ -18,16 +18,79 @@ PpContext *pp_create(void);
 //
 void pp_free(PpContext *ctx);
 
+//
+// Memory living as long as the context, freed all at once with it
+//
+struct Arena *pp_arena(PpContext *ctx);
+
 //
 // Print an error message then exit
 //
 void __attribute__((noreturn)) pp_err(PpContext *ctx, const char *err, ...);
 
+//
+// Print errors to fp, then call handler instead of exiting, it must not return
+// (e.g. longjmp), the context can only be freed after that
+//
+void pp_set_err(PpContext *ctx, FILE *fp, void (*handler)(void *), void *arg);
+
+//
+// Keep the contents of files read by any context of the process for reuse,
+// up to budget bytes in total (0 disables the cache), files no context reads
+// and not used lately make room for new ones
+//
+void pp_cache_enable(size_t budget);
+
+//
+// Get the cache counters: opens served from it, opens that read the file,
+// and bytes kept
+//
+void pp_cache_stats(size_t *hits, size_t *misses, size_t *bytes);
+
+//
+// Free the cache, no context may be reading files at the time
+//
+void pp_cache_free(void);
+
+//
+// Memoize the expansions of function-like macro invocations, keeping up to
+// budget bytes of them (0 disables memoization, the default)
+//
+void pp_memo_enable(PpContext *ctx, size_t budget);
+
+//
+// Print the memoization hits and misses of the top macros by hits
+//
+void pp_print_memo(PpContext *ctx, FILE *fp, size_t top);
+
+//
+// Record the cost of every macro expanded, for pp_print_profile
+//
+void pp_profile_macros(PpContext *ctx);
+
+//
+// Print the cost of the top macros by inclusive time, or of every macro as
+// JSON
+//
+void pp_print_profile(PpContext *ctx, FILE *fp, _Bool json);
+
+//
+// Open relative paths from the directory open at dirfd instead of the working
+// directory, it must stay open as long as the context
+//
+void pp_set_dir(PpContext *ctx, int dirfd);
+
 //
 // Add a search directory to the pre-processor
 //
 void pp_add_search_dir(PpContext *ctx, const char *dir);
 
+//
+// Add a system header search directory, headers found in there (and the
+// ones they include) are left out of dependencies without system headers
+//
+void pp_add_system_dir(PpContext *ctx, const char *dir);
+
 //
 // Push a file to the pre-processor stack
 //
@@ -43,4 +106,115 @@ void pp_push_string(PpContext *ctx, const char *path, const char *str);
 //
 Token *pp_next(PpContext *ctx);
 
+//
+// Source location of the pre-processor
+//
+typedef struct {
+    // Path of the file being read
+    const char *path;
+    // Line number in that file
+    size_t line;
+    // Include depth of that file, 0 for the main file
+    size_t depth;
+} PpLocation;
+
+//
+// Get the location the last token was read from, returns 0 once all files
+// were read
+//
+_Bool pp_location(PpContext *ctx, PpLocation *loc);
+
+//
+// Write the pre-processed text to a file descriptor, with line markers,
+// returns 0, or -1 with errno set if writing failed (pre-processing still
+// goes on to the end, without output)
+//
+int pp_write(PpContext *ctx, int fd);
+
+//
+// Write the pre-processed text of a main file to a file descriptor, like
+// pp_push_string then pp_write, checkpointing the state of the context along
+// the way. Calling it again with edited contents only pre-processes again
+// from the last checkpoint before the first change (and before reading any
+// header changed since), the output is the same as a full run. Returns the
+// offset of the main file it resumed from, 0 for a full run, or (size_t) -1
+// with errno set if writing failed. No other frame
+// may be pushed on the context, and the include report isn't kept.
+//
+size_t pp_write_incremental(PpContext *ctx, const char *path, const char *str,
+                            int fd);
+
+//
+// Pre-processor running on a thread of its own
+//
+typedef struct PpPipe PpPipe;
+
+//
+// Pre-process on a thread of its own from now on, handing the tokens over in
+// batches through a ring, until the pipe is freed the context must not be
+// used. Errors are reported once the tokens before them are read.
+//
+PpPipe *pp_pipe_start(PpContext *ctx);
+
+//
+// Get the next pre-processed token from the pipe
+//
+Token *pp_pipe_next(PpPipe *pipe);
+
+//
+// Get the location of the last token read that started a line, returns 0 if
+// it had none
+//
+_Bool pp_pipe_location(PpPipe *pipe, PpLocation *loc);
+
+//
+// Memory for the reader of the pipe, freed all at once with it
+//
+struct Arena *pp_pipe_arena(PpPipe *pipe);
+
+//
+// Print an error message at the location of the reader of the pipe, stopping
+// the pre-processor, then exit (or call the error handler)
+//
+void __attribute__((noreturn)) pp_pipe_err(PpPipe *pipe, const char *err, ...);
+
+//
+// Stop the pre-processor thread (if still running) and free the pipe, the
+// context can be used again
+//
+void pp_pipe_free(PpPipe *pipe);
+
+//
+// Write the pre-processed text read from a pipe, like pp_write
+//
+int pp_write_pipe(PpPipe *pipe, int fd);
+
+//
+// Run only the directives of every file, skipping everything else without
+// macro expansion (for finding dependencies)
+//
+void pp_scan(PpContext *ctx);
+
+//
+// Record the cost of every file read, for pp_print_includes
+//
+void pp_report_includes(PpContext *ctx);
+
+//
+// Print the include tree with the time, tokens and macros of each file, then
+// the top headers by total time
+//
+void pp_print_includes(PpContext *ctx, FILE *fp, size_t top);
+
+//
+// Print the statistics counters (if compiled in with PP_STATS)
+//
+void pp_print_stats(PpContext *ctx, FILE *fp);
+
+//
+// Write the files read so far as a Make rule for target, leaving out system
+// headers unless requested
+//
+void pp_write_deps(PpContext *ctx, FILE *fp, const char *target, _Bool system);
+
 #endif
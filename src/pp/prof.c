@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//
+// Pre-processor: macro expansion profile
+//
+// Expansions are spliced into the pending tokens and rescanned as they are
+// read, so an expansion lasts from its invocation until reading goes below
+// its tokens. Nested expansions are counted in the time and tokens of every
+// expansion around them.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vec.h>
+#include <hash.h>
+#include <pool.h>
+#include <arena.h>
+#include <lex/token.h>
+#include <lex/lex.h>
+#include "pp.h"
+#include "def.h"
+
+// Number of macros in the text report
+#define PROFILE_TOP 20
+
+void pp_profile_macros(PpContext *ctx)
+{
+    ctx->profile = 1;
+}
+
+MacroProfile *prof_entry(PpContext *ctx, Macro *macro)
+{
+    // Macros with the same name share the entry, even after being redefined
+    if (!macro->profile) {
+        size_t *index = profile_map_find(&ctx->profile_names, macro->ident);
+        if (!index) {
+            profile_list_add(&ctx->profiles,
+                (MacroProfile) { .name = macro->ident });
+            index = profile_map_put(&ctx->profile_names, macro->ident,
+                ctx->profiles.n - 1);
+        }
+        macro->profile = *index + 1;
+    }
+    return ctx->profiles.arr + macro->profile - 1;
+}
+
+void prof_begin(PpContext *ctx, Macro *macro, double start)
+{
+    MacroProfile *profile = prof_entry(ctx, macro);
+    ++profile->invocations;
+    if (macro->function_like)
+        profile->pre_time += wall_time() - start;
+
+    prof_stack_add(&ctx->prof_frames, (ProfFrame) {
+        .profile = profile - ctx->profiles.arr,
+        .level = ctx->pending.n,
+        .start = start,
+        .tokens = ctx->prof_tokens,
+    });
+    if (profile->max_depth < ctx->prof_frames.n)
+        profile->max_depth = ctx->prof_frames.n;
+}
+
+void prof_end(PpContext *ctx)
+{
+    ProfFrame frame = prof_stack_pop(&ctx->prof_frames);
+    MacroProfile *profile = ctx->profiles.arr + frame.profile;
+    profile->time += wall_time() - frame.start;
+    profile->tokens += ctx->prof_tokens - frame.tokens;
+}
+
+static int cmp_profile_time(const void *a, const void *b)
+{
+    double ta = ((const MacroProfile *) a)->time;
+    double tb = ((const MacroProfile *) b)->time;
+    return (ta < tb) - (ta > tb);
+}
+
+// Write a string as a JSON string literal
+static void write_json_str(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; ++s)
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else
+            fputc(*s, fp);
+    fputc('"', fp);
+}
+
+void pp_print_profile(PpContext *ctx, FILE *fp, _Bool json)
+{
+    // Expansions still going on at the end are left out
+    size_t n = ctx->profiles.n;
+    MacroProfile *profiles = malloc((n + 1) * sizeof *profiles);
+    memcpy(profiles, ctx->profiles.arr, n * sizeof *profiles);
+    qsort(profiles, n, sizeof *profiles, cmp_profile_time);
+
+    if (json) {
+        fprintf(fp, "[\n");
+        for (size_t i = 0; i < n; ++i) {
+            MacroProfile *p = profiles + i;
+            fprintf(fp, "  {\"name\": ");
+            write_json_str(fp, p->name);
+            fprintf(fp, ", \"invocations\": %zu, \"tokens\": %zu, "
+                        "\"max_depth\": %zu, \"pre_expanded\": %zu, "
+                        "\"pre_expand_ms\": %.3f, \"inclusive_ms\": %.3f}%s\n",
+                p->invocations, p->tokens, p->max_depth, p->pre_expanded,
+                p->pre_time * 1e3, p->time * 1e3, i + 1 < n ? "," : "");
+        }
+        fprintf(fp, "]\n");
+        free(profiles);
+        return;
+    }
+
+    size_t top = n < PROFILE_TOP ? n : PROFILE_TOP;
+    fprintf(fp, "Top %zu macros by inclusive time:\n", top);
+    fprintf(fp, "%10s %10s %10s %8s %5s %8s %10s  %s\n", "ms", "calls",
+        "tokens", "tok/call", "depth", "actuals", "actual ms", "macro");
+    for (size_t i = 0; i < top; ++i) {
+        MacroProfile *p = profiles + i;
+        fprintf(fp, "%10.3f %10zu %10zu %8.1f %5zu %8zu %10.3f  %s\n",
+            p->time * 1e3, p->invocations, p->tokens,
+            p->invocations ? (double) p->tokens / p->invocations : 0,
+            p->max_depth, p->pre_expanded, p->pre_time * 1e3, p->name);
+    }
+    free(profiles);
+}
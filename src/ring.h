@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: ISC
+
+#ifndef RING_H
+#define RING_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Polls of the other side before sleeping on a full or empty ring
+#ifndef RING_SPINS
+#define RING_SPINS 256
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RING_PAUSE() __builtin_ia32_pause()
+#else
+#define RING_PAUSE() ((void) 0)
+#endif
+
+//
+// Generate type specific definitions of a single producer, single consumer
+// ring of N slots
+//
+// The producer fills slots in place and commits them, the consumer reads
+// them in the same order and releases them. Each counter is only written by
+// one side, handing a slot over takes no lock. A side finding the ring full
+// (or empty) polls for a while, then sleeps until the other side moves, so
+// the producer is held back once the consumer is N slots behind.
+//
+// The producer closes the ring when it's done, the consumer cancels it to
+// stop the producer early.
+//
+#define RING_GEN(type, N, stru_name, fn_pre)                                   \
+                                                                               \
+typedef struct {                                                               \
+    type            slots[N];                                                  \
+    /* Slots committed and released, apart so the sides don't share a line */  \
+    size_t          head __attribute__((aligned(64)));                         \
+    size_t          tail __attribute__((aligned(64)));                         \
+    _Bool           closed;    /* No more slots will be committed */           \
+    _Bool           cancelled; /* No more slots will be read */                \
+    int             sleepers;  /* Sides sleeping on wake */                    \
+    pthread_mutex_t lock;                                                      \
+    pthread_cond_t  wake;                                                      \
+} stru_name;                                                                   \
+                                                                               \
+static inline void fn_pre##_init(stru_name *self)                              \
+{                                                                              \
+    self->head = self->tail = 0;                                               \
+    self->closed = self->cancelled = 0;                                        \
+    self->sleepers = 0;                                                        \
+    pthread_mutex_init(&self->lock, NULL);                                     \
+    pthread_cond_init(&self->wake, NULL);                                      \
+}                                                                              \
+                                                                               \
+static inline void fn_pre##_free(stru_name *self)                              \
+{                                                                              \
+    pthread_cond_destroy(&self->wake);                                         \
+    pthread_mutex_destroy(&self->lock);                                        \
+}                                                                              \
+                                                                               \
+static inline _Bool fn_pre##_can_write(stru_name *self)                        \
+{                                                                              \
+    return __atomic_load_n(&self->head, __ATOMIC_RELAXED)                      \
+        - __atomic_load_n(&self->tail, __ATOMIC_SEQ_CST) < (N)                 \
+        || __atomic_load_n(&self->cancelled, __ATOMIC_SEQ_CST);                \
+}                                                                              \
+                                                                               \
+static inline _Bool fn_pre##_can_read(stru_name *self)                         \
+{                                                                              \
+    return __atomic_load_n(&self->tail, __ATOMIC_RELAXED)                      \
+        != __atomic_load_n(&self->head, __ATOMIC_SEQ_CST)                      \
+        || __atomic_load_n(&self->closed, __ATOMIC_SEQ_CST);                   \
+}                                                                              \
+                                                                               \
+/* Wait for ready to hold, sleeping after a while: the other side checks */    \
+/* for sleepers after it moves, so it can't miss waking this one up */         \
+static inline void fn_pre##_wait(stru_name *self,                              \
+    _Bool (*ready)(stru_name *))                                               \
+{                                                                              \
+    for (int i = 0; i < RING_SPINS; ++i) {                                     \
+        if (ready(self))                                                       \
+            return;                                                            \
+        RING_PAUSE();                                                          \
+    }                                                                          \
+    pthread_mutex_lock(&self->lock);                                           \
+    __atomic_add_fetch(&self->sleepers, 1, __ATOMIC_SEQ_CST);                  \
+    while (!ready(self))                                                       \
+        pthread_cond_wait(&self->wake, &self->lock);                           \
+    __atomic_sub_fetch(&self->sleepers, 1, __ATOMIC_SEQ_CST);                  \
+    pthread_mutex_unlock(&self->lock);                                         \
+}                                                                              \
+                                                                               \
+static inline void fn_pre##_notify(stru_name *self)                            \
+{                                                                              \
+    if (__atomic_load_n(&self->sleepers, __ATOMIC_SEQ_CST)) {                  \
+        pthread_mutex_lock(&self->lock);                                       \
+        pthread_cond_broadcast(&self->wake);                                   \
+        pthread_mutex_unlock(&self->lock);                                     \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+/* Slot to fill next, NULL if the ring was cancelled */                        \
+static inline type *fn_pre##_write_slot(stru_name *self)                       \
+{                                                                              \
+    fn_pre##_wait(self, fn_pre##_can_write);                                   \
+    if (__atomic_load_n(&self->cancelled, __ATOMIC_SEQ_CST))                   \
+        return NULL;                                                           \
+    return self->slots + self->head % (N);                                     \
+}                                                                              \
+                                                                               \
+static inline void fn_pre##_commit(stru_name *self)                            \
+{                                                                              \
+    __atomic_store_n(&self->head, self->head + 1, __ATOMIC_SEQ_CST);           \
+    fn_pre##_notify(self);                                                     \
+}                                                                              \
+                                                                               \
+static inline void fn_pre##_close(stru_name *self)                             \
+{                                                                              \
+    __atomic_store_n(&self->closed, 1, __ATOMIC_SEQ_CST);                      \
+    fn_pre##_notify(self);                                                     \
+}                                                                              \
+                                                                               \
+/* Slot to read next, NULL once every slot committed before closing the */     \
+/* ring was read */                                                            \
+static inline type *fn_pre##_read_slot(stru_name *self)                        \
+{                                                                              \
+    fn_pre##_wait(self, fn_pre##_can_read);                                    \
+    if (self->tail == __atomic_load_n(&self->head, __ATOMIC_SEQ_CST))          \
+        return NULL;                                                           \
+    return self->slots + self->tail % (N);                                     \
+}                                                                              \
+                                                                               \
+static inline void fn_pre##_release(stru_name *self)                           \
+{                                                                              \
+    __atomic_store_n(&self->tail, self->tail + 1, __ATOMIC_SEQ_CST);           \
+    fn_pre##_notify(self);                                                     \
+}                                                                              \
+                                                                               \
+static inline void fn_pre##_cancel(stru_name *self)                            \
+{                                                                              \
+    __atomic_store_n(&self->cancelled, 1, __ATOMIC_SEQ_CST);                   \
+    fn_pre##_notify(self);                                                     \
+}
+
+#endif
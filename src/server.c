@@ -0,0 +1,312 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//
+// Compile server: a long lived process keeps the file cache warm for
+// clients connecting to it over a Unix socket
+//
+// A request is the client's working directory, command line and environment.
+// The reply is a series of frames with the command's output, then one with
+// its exit status. Strings and frames are sent as a length, then the data.
+//
+// Every connection is served on a thread of its own. The working directory and
+// environment belong to the whole process, so they're left alone: the command
+// opens relative paths from the client's directory, and gets the client's
+// environment to read from.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "server.h"
+
+extern char **environ;
+
+// Most bytes of a request, like the kernel's limit on the arguments and
+// environment of a program, and of each of its strings
+#define REQUEST_MAX (2 << 20)
+#define STRING_MAX  (128 << 10)
+
+typedef enum {
+    FRAME_STDOUT,   // Data written to stdout
+    FRAME_STDERR,   // Data written to stderr
+    FRAME_EXIT,     // Exit status (in the length field)
+} FrameType;
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    for (const char *p = buf; len; ) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    for (char *p = buf; len; ) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_u32(int fd, uint32_t val)
+{
+    return write_all(fd, &val, sizeof val);
+}
+
+static int read_u32(int fd, uint32_t *val)
+{
+    return read_all(fd, val, sizeof *val);
+}
+
+static int write_str(int fd, const char *str)
+{
+    size_t len = strlen(str);
+    if (write_u32(fd, len) < 0)
+        return -1;
+    return write_all(fd, str, len);
+}
+
+// Read a string, counting its bytes against the ones left to the request
+static char *read_str(int fd, size_t *left)
+{
+    uint32_t len;
+    if (read_u32(fd, &len) < 0 || len > STRING_MAX
+            || sizeof len + (size_t) len > *left)
+        return NULL;
+    *left -= sizeof len + (size_t) len;
+    char *str = malloc((size_t) len + 1);
+    if (!str || read_all(fd, str, len) < 0) {
+        free(str);
+        return NULL;
+    }
+    str[len] = 0;
+    return str;
+}
+
+// Read an array of strings, NULL terminated
+static char **read_strs(int fd, uint32_t *count, size_t *left)
+{
+    // NOTE: every string takes at least its length, bounding the count
+    if (read_u32(fd, count) < 0 || sizeof *count > *left
+            || *count > (*left - sizeof *count) / sizeof *count)
+        return NULL;
+    *left -= sizeof *count;
+    char **strs = calloc((size_t) *count + 1, sizeof *strs);
+    if (!strs)
+        return NULL;
+    for (uint32_t i = 0; i < *count; ++i)
+        if (!(strs[i] = read_str(fd, left))) {
+            for (uint32_t j = 0; j < i; ++j)
+                free(strs[j]);
+            free(strs);
+            return NULL;
+        }
+    return strs;
+}
+
+static void free_strs(char **strs)
+{
+    if (!strs)
+        return;
+    for (char **p = strs; *p; ++p)
+        free(*p);
+    free(strs);
+}
+
+static int write_frame(int fd, FrameType type, const void *buf, uint32_t len)
+{
+    uint32_t header[2] = { type, len };
+    if (write_all(fd, header, sizeof header) < 0)
+        return -1;
+    return write_all(fd, buf, type == FRAME_EXIT ? 0 : len);
+}
+
+// Send the contents of a temporary file as frames, then close it
+static int send_tmpfile(int fd, FrameType type, FILE *tmp)
+{
+    char buf[65536];
+    size_t n;
+    int result = 0;
+
+    fflush(tmp);
+    rewind(tmp);
+    while (result == 0 && (n = fread(buf, 1, sizeof buf, tmp)))
+        result = write_frame(fd, type, buf, n);
+    fclose(tmp);
+    return result;
+}
+
+// Connection being served
+typedef struct {
+    int conn;
+    ServerCommand command;
+} Request;
+
+static void serve(int conn, ServerCommand command)
+{
+    size_t left = REQUEST_MAX;
+    char *cwd = read_str(conn, &left), **argv = NULL, **envp = NULL;
+    uint32_t argc, envc;
+    if (!cwd || !(argv = read_strs(conn, &argc, &left)) || !argc
+            || !(envp = read_strs(conn, &envc, &left)))
+        goto end;
+
+    // Only this client goes without a reply
+    FILE *out = tmpfile(), *err = tmpfile();
+    if (!out || !err) {
+        perror("tmpfile");
+        if (out)
+            fclose(out);
+        if (err)
+            fclose(err);
+        goto end;
+    }
+
+    int status, dirfd = open(cwd, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        fprintf(err, "%s: %s\n", cwd, strerror(errno));
+        status = 1;
+    } else {
+        status = command(dirfd, envp, argc, argv, out, err);
+        close(dirfd);
+    }
+
+    if (send_tmpfile(conn, FRAME_STDOUT, out) == 0
+            && send_tmpfile(conn, FRAME_STDERR, err) == 0)
+        write_frame(conn, FRAME_EXIT, NULL, status);
+
+end:
+    free(cwd);
+    free_strs(argv);
+    free_strs(envp);
+}
+
+static void *serve_thread(void *arg)
+{
+    Request *req = arg;
+    serve(req->conn, req->command);
+    close(req->conn);
+    free(req);
+    return NULL;
+}
+
+static int socket_addr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr->sun_path) {
+        fprintf(stderr, "%s: Socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int server_run(const char *path, ServerCommand command)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (socket_addr(&addr, path) < 0)
+        return 1;
+    // Replace the socket of a previous server, but nothing else
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || bind(sock, (struct sockaddr *) &addr, sizeof addr) < 0
+            || listen(sock, SOMAXCONN) < 0) {
+        perror(path);
+        return 1;
+    }
+    // Clients going away must not take the server with them
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            close(sock);
+            return 1;
+        }
+
+        Request *req = malloc(sizeof *req);
+        *req = (Request) { conn, command };
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_thread, req)) {
+            perror("pthread_create");
+            close(conn);
+            free(req);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+int client_run(const char *path, int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+
+    if (socket_addr(&addr, path) < 0)
+        return 1;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *) &addr, sizeof addr) < 0) {
+        perror(path);
+        return 1;
+    }
+
+    // Send the request
+    char *cwd = getcwd(NULL, 0);
+    int failed = !cwd || write_str(sock, cwd) < 0 || write_u32(sock, argc) < 0;
+    free(cwd);
+    for (int i = 0; !failed && i < argc; ++i)
+        failed = write_str(sock, argv[i]) < 0;
+    uint32_t envc = 0;
+    while (environ[envc])
+        ++envc;
+    failed = failed || write_u32(sock, envc) < 0;
+    for (uint32_t i = 0; !failed && i < envc; ++i)
+        failed = write_str(sock, environ[i]) < 0;
+
+    // Copy back the output until the exit status arrives
+    char buf[65536];
+    uint32_t header[2];
+    while (!failed && read_all(sock, header, sizeof header) == 0) {
+        if (header[0] == FRAME_EXIT) {
+            close(sock);
+            return header[1];
+        }
+        if (header[1] > sizeof buf || read_all(sock, buf, header[1]) < 0)
+            break;
+        write_all(header[0] == FRAME_STDOUT ? STDOUT_FILENO : STDERR_FILENO,
+            buf, header[1]);
+    }
+
+    fprintf(stderr, "%s: Lost connection to the server\n", path);
+    close(sock);
+    return 1;
+}
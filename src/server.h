@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef SERVER_H
+#define SERVER_H
+
+//
+// Command line handler of the server, runs in the client's environment envp,
+// writes to out and err instead of stdout and stderr, opens relative paths
+// from the directory open at dirfd, and returns the exit status
+//
+typedef int (*ServerCommand)(int dirfd, char *envp[], int argc, char *argv[],
+                             FILE *out, FILE *err);
+
+//
+// Serve command lines sent to a Unix socket at path, each connection on a
+// thread of its own, in the client's working directory and environment,
+// returns only on failure
+//
+int server_run(const char *path, ServerCommand command);
+
+//
+// Send a command line to the server at path, copy back its output and
+// return its exit status
+//
+int client_run(const char *path, int argc, char *argv[]);
+
+#endif
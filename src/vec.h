@@ -11,39 +11,20 @@
 #define VEC_MINSIZE 8
 #endif
 
+// Inline size of string builders
+#ifndef SB_SMALLSIZE
+#define SB_SMALLSIZE 64
+#endif
+
 // Grow factor when full
 #ifndef VEC_GROW_FACTOR
 #define VEC_GROW_FACTOR 2
 #endif
 
 //
-// Generate type specific definitions
+// Generate the operations shared by the vector types
 //
-#define VEC_GEN(type, stru_name, fn_pre)                                       \
-                                                                               \
-typedef struct {                                                               \
-    size_t n;    /* Number of elements */                                      \
-    size_t size; /* Size of the arr */                                         \
-    type   *arr; /* The backing arr */                                         \
-} stru_name;                                                                   \
-                                                                               \
-static inline void fn_pre##_init(stru_name *self)                              \
-{                                                                              \
-    self->n = 0;                                                               \
-    self->size = VEC_MINSIZE;                                                  \
-    self->arr = reallocarray(NULL, self->size, sizeof(type));                  \
-}                                                                              \
-                                                                               \
-static inline void fn_pre##_free(stru_name *self)                              \
-{                                                                              \
-    free(self->arr);                                                           \
-}                                                                              \
-                                                                               \
-static inline void fn_pre##_reserve(stru_name *self, size_t size)              \
-{                                                                              \
-    self->size = size;                                                         \
-    self->arr = reallocarray(self->arr, self->size, sizeof(type));             \
-}                                                                              \
+#define VEC_GEN_OPS(type, stru_name, fn_pre)                                   \
                                                                                \
 static inline void fn_pre##_add(stru_name *self, type m)                       \
 {                                                                              \
@@ -84,14 +65,90 @@ static inline void fn_pre##_extend(stru_name *self, stru_name *other)          \
 }
 
 //
-// String builder (character vector) type
+// Generate type specific definitions
+//
+#define VEC_GEN(type, stru_name, fn_pre)                                       \
+                                                                               \
+typedef struct {                                                               \
+    size_t n;    /* Number of elements */                                      \
+    size_t size; /* Size of the arr */                                         \
+    type   *arr; /* The backing arr */                                         \
+} stru_name;                                                                   \
+                                                                               \
+static inline void fn_pre##_init(stru_name *self)                              \
+{                                                                              \
+    self->n = 0;                                                               \
+    self->size = VEC_MINSIZE;                                                  \
+    self->arr = reallocarray(NULL, self->size, sizeof(type));                  \
+}                                                                              \
+                                                                               \
+static inline void fn_pre##_free(stru_name *self)                              \
+{                                                                              \
+    free(self->arr);                                                           \
+}                                                                              \
+                                                                               \
+static inline void fn_pre##_reserve(stru_name *self, size_t size)              \
+{                                                                              \
+    self->size = size;                                                         \
+    self->arr = reallocarray(self->arr, self->size, sizeof(type));             \
+}                                                                              \
+                                                                               \
+VEC_GEN_OPS(type, stru_name, fn_pre)
+
+//
+// Generate type specific definitions for a vector keeping its first N
+// elements inline, only growing past them allocates. The arr points into the
+// vector itself until then, so it must stay in place (e.g. a local or a
+// member of a heap object, not an element of another vector).
+//
+#define VEC_GEN_SMALL(type, N, stru_name, fn_pre)                              \
+                                                                               \
+typedef struct {                                                               \
+    size_t n;         /* Number of elements */                                 \
+    size_t size;      /* Size of the arr */                                    \
+    type   *arr;      /* The backing arr */                                    \
+    type   small[N];  /* Inline storage, the arr until it's outgrown */        \
+} stru_name;                                                                   \
+                                                                               \
+static inline void fn_pre##_init(stru_name *self)                              \
+{                                                                              \
+    self->n = 0;                                                               \
+    self->size = N;                                                            \
+    self->arr = self->small;                                                   \
+}                                                                              \
+                                                                               \
+static inline void fn_pre##_free(stru_name *self)                              \
+{                                                                              \
+    if (self->arr != self->small)                                              \
+        free(self->arr);                                                       \
+}                                                                              \
+                                                                               \
+static inline void fn_pre##_reserve(stru_name *self, size_t size)              \
+{                                                                              \
+    if (self->arr != self->small) {                                            \
+        self->size = size;                                                     \
+        self->arr = reallocarray(self->arr, self->size, sizeof(type));         \
+    } else if (size > N) {                                                     \
+        self->size = size;                                                     \
+        self->arr = reallocarray(NULL, self->size, sizeof(type));              \
+        memcpy(self->arr, self->small, N * sizeof(type));                      \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+VEC_GEN_OPS(type, stru_name, fn_pre)
+
+//
+// String builder (character vector) type, most strings fit inline
 //
 
-VEC_GEN(char, StringBuilder, sb)
+VEC_GEN_SMALL(char, SB_SMALLSIZE, StringBuilder, sb)
 
 static inline char *sb_str(StringBuilder *self)
 {
     sb_add(self, 0);
+    // The string outlives the builder
+    if (self->arr == self->small)
+        return memcpy(malloc(self->n), self->small, self->n);
     return self->arr;
 }
 
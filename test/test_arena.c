@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Arena tests
+ *
+ * Allocations of mixed sizes are filled in, then checked to be aligned,
+ * zeroed when handed out, and not overlapping each other.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <arena.h>
+
+#define NALLOCS 1000
+
+static void test_alloc(void)
+{
+    static unsigned char *ptrs[NALLOCS];
+    static size_t sizes[NALLOCS];
+    Arena arena;
+    arena_init(&arena);
+
+    for (size_t i = 0; i < NALLOCS; ++i) {
+        // Every 100th is large enough to get a chunk of its own
+        sizes[i] = i % 100 == 99 ? ARENA_CHUNK_SIZE : i % 37 + 1;
+        ptrs[i] = arena_alloc(&arena, sizes[i]);
+        assert((uintptr_t) ptrs[i] % ARENA_ALIGN == 0);
+        for (size_t j = 0; j < sizes[i]; ++j)
+            assert(!ptrs[i][j]);
+        memset(ptrs[i], i, sizes[i]);
+    }
+    for (size_t i = 0; i < NALLOCS; ++i)
+        for (size_t j = 0; j < sizes[i]; ++j)
+            assert(ptrs[i][j] == (unsigned char) i);
+
+    const char *str = arena_strdup(&arena, "arena");
+    assert(!strcmp(str, "arena"));
+
+    arena_free(&arena);
+    assert(!arena.chunks && !arena.size);
+    // Can be used again after being freed
+    assert(arena_alloc(&arena, 8));
+    arena_free(&arena);
+}
+
+int main(void)
+{
+    test_alloc();
+}
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Hash map tests
+ *
+ * Entries are added and removed in the maps while keeping the same entries in
+ * an array, then each key is looked up in both. Run with "bench" as argument
+ * to compare the lookups against a linear scan instead.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include <hash.h>
+
+HASH_GEN(const char *, int, StrMap, str_map, hash_str, hash_str_eq)
+
+// Everything collides in a few home slots, so entries wrap around the end
+// and removals shift long runs back
+static size_t hash_bad(size_t key)
+{
+    return (size_t) -1 - key % 3 * 5;
+}
+
+static _Bool size_eq(size_t a, size_t b)
+{
+    return a == b;
+}
+
+HASH_GEN(size_t, size_t, BadMap, bad_map, hash_bad, size_eq)
+
+#define NKEYS 5000
+
+static char keys[NKEYS][16];
+
+static void make_keys(void)
+{
+    for (size_t i = 0; i < NKEYS; ++i)
+        snprintf(keys[i], sizeof keys[i], "key%zu", i);
+}
+
+// Check every key is found with its value, or isn't found if removed
+static void assert_str_map(StrMap *map, int values[])
+{
+    size_t n = 0;
+    for (size_t i = 0; i < NKEYS; ++i) {
+        int *value = str_map_find(map, keys[i]);
+        if (values[i] < 0) {
+            assert(!value);
+        } else {
+            assert(value && *value == values[i]);
+            ++n;
+        }
+    }
+    assert(map->n == n);
+}
+
+static void test_str_map(void)
+{
+    static int values[NKEYS];
+    StrMap map;
+    str_map_init(&map);
+    assert(!str_map_find(&map, "key0"));
+
+    for (size_t i = 0; i < NKEYS; ++i) {
+        values[i] = i;
+        assert(*str_map_put(&map, keys[i], i) == (int) i);
+    }
+    assert_str_map(&map, values);
+
+    // Replace some
+    for (size_t i = 0; i < NKEYS; i += 7)
+        str_map_put(&map, keys[i], values[i] += NKEYS);
+    assert_str_map(&map, values);
+
+    // Remove every other, and some twice
+    StrMapEntry removed;
+    for (size_t i = 0; i < NKEYS; i += 2) {
+        assert(str_map_remove(&map, keys[i], &removed));
+        assert(removed.key == keys[i] && removed.value == values[i]);
+        values[i] = -1;
+    }
+    for (size_t i = 0; i < NKEYS; i += 4)
+        assert(!str_map_remove(&map, keys[i], NULL));
+    assert_str_map(&map, values);
+
+    // Add them back
+    for (size_t i = 0; i < NKEYS; i += 2)
+        str_map_put(&map, keys[i], values[i] = i * 3);
+    assert_str_map(&map, values);
+
+    // Walking the slots finds each entry once
+    size_t sum = 0, n = 0;
+    for (size_t i = 0; i < map.size; ++i)
+        if (map.arr[i].hash) {
+            sum += map.arr[i].value;
+            ++n;
+        }
+    size_t expected = 0;
+    for (size_t i = 0; i < NKEYS; ++i)
+        expected += values[i];
+    assert(n == map.n && sum == expected);
+
+    str_map_free(&map);
+}
+
+static void test_collisions(void)
+{
+    static _Bool present[NKEYS / 10];
+    BadMap map;
+    bad_map_init(&map);
+    bad_map_reserve(&map, NKEYS / 10);
+    size_t size = map.size;
+
+    // Add, remove and add back in an order mixing up the runs
+    for (size_t i = 0; i < NKEYS / 10; ++i) {
+        bad_map_put(&map, i, i + 1);
+        present[i] = 1;
+    }
+    for (size_t i = 0; i < NKEYS / 10; i += 3) {
+        assert(bad_map_remove(&map, i, NULL));
+        present[i] = 0;
+    }
+    for (size_t i = 0; i < NKEYS / 10; i += 6) {
+        bad_map_put(&map, i, i + 1);
+        present[i] = 1;
+    }
+    // Reserved room was enough
+    assert(map.size == size);
+
+    for (size_t i = 0; i < NKEYS / 10; ++i) {
+        size_t *value = bad_map_find(&map, i);
+        assert(present[i] ? value && *value == i + 1 : !value);
+    }
+    bad_map_free(&map);
+}
+
+static void bench(void)
+{
+    enum { ROUNDS = 200 };
+    StrMap map;
+    str_map_init(&map);
+    for (size_t i = 0; i < NKEYS; ++i)
+        str_map_put(&map, keys[i], i);
+
+    // Look up copies of the keys, as a lexer would
+    static char copies[NKEYS][16];
+    memcpy(copies, keys, sizeof keys);
+
+    size_t found = 0;
+    clock_t start = clock();
+    for (size_t r = 0; r < ROUNDS; ++r)
+        for (size_t i = 0; i < NKEYS; ++i)
+            found += *str_map_find(&map, copies[i]);
+    double map_time = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (size_t r = 0; r < ROUNDS / 20; ++r)
+        for (size_t i = 0; i < NKEYS; ++i)
+            for (size_t j = 0; j < NKEYS; ++j)
+                if (!strcmp(keys[j], copies[i])) {
+                    found += j;
+                    break;
+                }
+    double scan_time = (double) (clock() - start) / CLOCKS_PER_SEC * 20;
+
+    printf("%d keys, %d rounds (checksum %zu)\n", NKEYS, ROUNDS, found);
+    printf("  hash map:    %8.3f ms, %6.1f ns/lookup\n", map_time * 1e3,
+        map_time * 1e9 / ROUNDS / NKEYS);
+    printf("  linear scan: %8.3f ms, %6.1f ns/lookup\n", scan_time * 1e3,
+        scan_time * 1e9 / ROUNDS / NKEYS);
+    str_map_free(&map);
+}
+
+int main(int argc, char *argv[])
+{
+    make_keys();
+    if (argc > 1 && !strcmp(argv[1], "bench")) {
+        bench();
+        return 0;
+    }
+    test_str_map();
+    test_collisions();
+}
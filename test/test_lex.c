@@ -8,6 +8,7 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
 #include <string.h>
 #include <vec.h>
 #include <lex/token.h>
@@ -118,9 +119,33 @@ static void test_spacing(void)
     lex_free(ctx);
 }
 
+// Spellings shorter and longer than the string builder's inline storage
+static void test_long_spelling(void)
+{
+    char src[4 * SB_SMALLSIZE + 8], ident[2 * SB_SMALLSIZE];
+    memset(ident, 'a', sizeof ident - 1);
+    ident[sizeof ident - 1] = 0;
+    snprintf(src, sizeof src, "b %s \"%s\"", ident, ident + 1);
+
+    LexCtx *ctx = lex_open_string("test_long_spelling.c", src);
+    Token *tmp = lex_next(ctx);
+    assert(tmp && !strcmp(tmp->data, "b"));
+    free_token(tmp);
+    tmp = lex_next(ctx);
+    assert(tmp && tmp->type == TK_IDENTIFIER && !strcmp(tmp->data, ident));
+    free_token(tmp);
+    tmp = lex_next(ctx);
+    assert(tmp && tmp->type == TK_STRING_LIT
+        && strlen(tmp->data) == strlen(ident) + 1);
+    free_token(tmp);
+    assert_next_null(ctx);
+    lex_free(ctx);
+}
+
 int main(void)
 {
     test_ppnum();
     test_punct();
     test_spacing();
+    test_long_spelling();
 }
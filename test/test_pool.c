@@ -0,0 +1,117 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Object pool tests
+ *
+ * Objects are allocated across several chunks, released and reset, checking
+ * which storage is handed out again. Run with "bench" as argument to compare
+ * allocating and releasing against malloc and free instead.
+ */
+
+#define POOL_POISON
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <pool.h>
+
+typedef struct {
+    void   *ptr;
+    size_t data[5];
+} Object;
+
+POOL_GEN(Object, ObjectPool, object_pool)
+
+// Enough for a few chunks
+#define NOBJECTS 2000
+
+static void test_alloc(void)
+{
+    static Object *objects[NOBJECTS];
+    ObjectPool pool;
+    object_pool_init(&pool);
+
+    for (size_t i = 0; i < NOBJECTS; ++i) {
+        Object *obj = objects[i] = object_pool_alloc(&pool);
+        assert(!obj->ptr && !obj->data[0] && !obj->data[4]);
+        assert((uintptr_t) obj % sizeof (void *) == 0);
+        obj->ptr = obj;
+        obj->data[4] = i;
+    }
+    assert(pool.chunks->next);
+    // Nothing was handed out twice
+    for (size_t i = 0; i < NOBJECTS; ++i)
+        assert(objects[i]->ptr == objects[i] && objects[i]->data[4] == i);
+
+    // Released objects are poisoned past the free list link, then reused
+    // last released first, zeroed
+    object_pool_release(&pool, objects[10]);
+    object_pool_release(&pool, objects[20]);
+#ifndef __SANITIZE_ADDRESS__
+    assert(((unsigned char *) objects[20])[sizeof (void *)]
+        == POOL_POISON_BYTE);
+#endif
+    assert(object_pool_alloc(&pool) == objects[20]);
+    Object *obj = object_pool_alloc(&pool);
+    assert(obj == objects[10] && !obj->data[4]);
+    assert(object_pool_alloc(&pool) != objects[10]);
+
+    // Reset starts over from the first chunk, without allocating new ones
+    ObjectPoolChunk *chunks = pool.chunks, *second = pool.chunks->next;
+    object_pool_reset(&pool);
+    assert(object_pool_alloc(&pool) == objects[0]);
+    for (size_t i = 1; i < NOBJECTS; ++i)
+        object_pool_alloc(&pool);
+    assert(pool.chunks == chunks && pool.chunks->next == second);
+
+    object_pool_free(&pool);
+}
+
+static void bench(void)
+{
+    enum { ROUNDS = 2000 };
+    static Object *objects[NOBJECTS];
+    ObjectPool pool;
+    object_pool_init(&pool);
+
+    // Allocate a batch, then release it in a different order
+    clock_t start = clock();
+    for (size_t r = 0; r < ROUNDS; ++r) {
+        for (size_t i = 0; i < NOBJECTS; ++i)
+            objects[i] = object_pool_alloc(&pool);
+        for (size_t i = 0; i < NOBJECTS; i += 2)
+            object_pool_release(&pool, objects[i]);
+        for (size_t i = 1; i < NOBJECTS; i += 2)
+            object_pool_release(&pool, objects[i]);
+    }
+    double pool_time = (double) (clock() - start) / CLOCKS_PER_SEC;
+    object_pool_free(&pool);
+
+    start = clock();
+    for (size_t r = 0; r < ROUNDS; ++r) {
+        for (size_t i = 0; i < NOBJECTS; ++i)
+            objects[i] = calloc(1, sizeof (Object));
+        for (size_t i = 0; i < NOBJECTS; i += 2)
+            free(objects[i]);
+        for (size_t i = 1; i < NOBJECTS; i += 2)
+            free(objects[i]);
+    }
+    double malloc_time = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%d objects of %zu bytes, %d rounds\n", NOBJECTS, sizeof (Object),
+        ROUNDS);
+    printf("  pool:   %8.3f ms, %5.1f ns/object\n", pool_time * 1e3,
+        pool_time * 1e9 / ROUNDS / NOBJECTS);
+    printf("  calloc: %8.3f ms, %5.1f ns/object\n", malloc_time * 1e3,
+        malloc_time * 1e9 / ROUNDS / NOBJECTS);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && !strcmp(argv[1], "bench")) {
+        bench();
+        return 0;
+    }
+    test_alloc();
+}
@@ -8,7 +8,14 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vec.h>
 #include <lex/token.h>
 #include <pp/pp.h>
@@ -57,6 +64,677 @@ static void assert_identical_result(const char *str1, const char *str2)
     pp_free(ctx2);
 }
 
+// Assert that the text output of pre-processing matches
+static void assert_output(const char *str, const char *want)
+{
+    PpContext *ctx = pp_create();
+    pp_push_string(ctx, "test_out.c", str);
+
+    FILE *fp = tmpfile();
+    assert(fp);
+    pp_write(ctx, fileno(fp));
+    pp_free(ctx);
+
+    size_t len = strlen(want);
+    char *buf = malloc(len + 1);
+    rewind(fp);
+    assert(fread(buf, 1, len + 1, fp) == len);
+    assert(!memcmp(buf, want, len));
+    free(buf);
+    fclose(fp);
+}
+
+// Assert that memoizing macro invocations doesn't change the result
+static void assert_memo_identical(const char *str)
+{
+    PpContext *ctx1, *ctx2;
+    Token *t1, *t2;
+
+    ctx1 = pp_create();
+    pp_memo_enable(ctx1, 1 << 20);
+    pp_push_string(ctx1, "test_pp1.c", str);
+    ctx2 = pp_create();
+    pp_push_string(ctx2, "test_pp2.c", str);
+
+    for (;;) {
+        t1 = pp_next(ctx1);
+        t2 = pp_next(ctx2);
+        assert_identical(t1, t2);
+        if (!t1)
+            break;
+        assert(t1->flags.lwhite == t2->flags.lwhite);
+        free_token(t1);
+        free_token(t2);
+    }
+
+    pp_free(ctx1);
+    pp_free(ctx2);
+}
+
+// Write a temporary file, path must be a mkstemp template
+static void write_tmp(char *path, const char *str)
+{
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    FILE *fp = fdopen(fd, "w");
+    assert(fp);
+    fputs(str, fp);
+    fclose(fp);
+}
+
+// Assert that including a header under changing macro definitions re-uses
+// the results of its #if expressions only while they are still valid
+static void assert_if_memo(void)
+{
+    char path[] = "/tmp/test_ppXXXXXX";
+    write_tmp(path,
+        "#if F(1) == 2\n"
+        "two\n"
+        "#elif defined(X) && X\n"
+        "x\n"
+        "#else\n"
+        "other\n"
+        "#endif\n");
+
+    char *str;
+    assert(asprintf(&str,
+        "#define F(a) a + 1\n"
+        "#include \"%s\"\n"
+        "#include \"%s\"\n"
+        "#undef F\n"
+        "#define F(a) a\n"
+        "#include \"%s\"\n"
+        "#define X 1\n"
+        "#include \"%s\"\n"
+        "#undef X\n"
+        "#define X 0\n"
+        "#include \"%s\"\n",
+        path, path, path, path, path) >= 0);
+    assert_identical_result(str, "two\ntwo\nother\nx\nother\n");
+    free(str);
+    unlink(path);
+}
+
+// Assert that blocks skipped through the index of a cached file end at the
+// same place as the first time
+static void assert_skip_index(void)
+{
+    char path[] = "/tmp/test_ppXXXXXX";
+    write_tmp(path,
+        "#ifdef A\n"
+        "a /*\n"
+        "#endif */\n"
+        "#elif B\n"
+        "#if 1\n"
+        "b\n"
+        "#endif\n"
+        "#else\n"
+        "c\n"
+        "#endif\n"
+        "#ifndef A\n"
+        "#else\n"
+        "#ifdef C\n"
+        "#endif\n"
+        "a\n"
+        "#endif\n"
+        "__LINE__\n");
+
+    char *str;
+    assert(asprintf(&str,
+        "#include \"%s\"\n"
+        "#define B 1\n"
+        "#include \"%s\"\n"
+        "#define A\n"
+        "#include \"%s\"\n",
+        path, path, path) >= 0);
+    pp_cache_enable(1 << 20);
+    for (int i = 0; i < 2; ++i)
+        assert_identical_result(str, "c\n17\nb\n17\na\na\n17\n");
+    pp_cache_free();
+    free(str);
+    unlink(path);
+}
+
+// Assert that a new version of a cached file replaces the old one, which is
+// still read by the contexts that had it open
+static void assert_cache_edit(void)
+{
+    char path[] = "/tmp/test_ppXXXXXX";
+    write_tmp(path, "a\n");
+    char *str;
+    assert(asprintf(&str, "#include \"%s\"\n", path) >= 0);
+    pp_cache_enable(1 << 20);
+    assert_identical_result(str, "a\n");
+
+    // Stopped inside the old version
+    PpContext *ctx = pp_create();
+    pp_push_string(ctx, "test_cache.c", str);
+    Token *token = pp_next(ctx);
+    assert(!strcmp(token_spelling(token), "a"));
+    free_token(token);
+
+    const char *versions[] = { "bb\n", "ccc\n", "d\n" };
+    for (size_t i = 0; i < 3; ++i) {
+        FILE *fp = fopen(path, "w");
+        assert(fp);
+        fputs(versions[i], fp);
+        fclose(fp);
+        assert_identical_result(str, versions[i]);
+        // Only the latest version is counted
+        size_t hits, misses, bytes;
+        pp_cache_stats(&hits, &misses, &bytes);
+        assert(bytes == strlen(versions[i]));
+    }
+
+    // The old version is still there to finish reading
+    token = pp_next(ctx);
+    assert(token && token->type == TK_NEW_LINE);
+    free_token(token);
+    assert(!pp_next(ctx));
+    pp_free(ctx);
+
+    pp_cache_free();
+    free(str);
+    unlink(path);
+}
+
+// Assert that a full cache makes room for new files with the ones no
+// context reads
+static void assert_cache_evict(void)
+{
+    char paths[3][19], *strs[3];
+    const char *contents[] = { "a1\n", "a2\n", "a3\n" };
+    for (size_t i = 0; i < 3; ++i) {
+        strcpy(paths[i], "/tmp/test_ppXXXXXX");
+        write_tmp(paths[i], contents[i]);
+        assert(asprintf(strs + i, "#include \"%s\"\n", paths[i]) >= 0);
+    }
+    // Room for two of them
+    pp_cache_enable(6);
+    size_t hits, misses, bytes, old_hits;
+
+    // Stopped inside the first one
+    PpContext *ctx = pp_create();
+    pp_push_string(ctx, "test_cache.c", strs[0]);
+    Token *token = pp_next(ctx);
+    assert(!strcmp(token_spelling(token), "a1"));
+    free_token(token);
+
+    // The second one makes room for the third, the first one is still read
+    assert_identical_result(strs[1], contents[1]);
+    assert_identical_result(strs[2], contents[2]);
+    pp_cache_stats(&hits, &misses, &bytes);
+    assert(misses == 3 && bytes == 6);
+    old_hits = hits;
+    assert_identical_result(strs[0], contents[0]);
+    assert_identical_result(strs[2], contents[2]);
+    pp_cache_stats(&hits, &misses, &bytes);
+    assert(hits == old_hits + 2 && misses == 3);
+
+    token = pp_next(ctx);
+    assert(token && token->type == TK_NEW_LINE);
+    free_token(token);
+    assert(!pp_next(ctx));
+    pp_free(ctx);
+
+    pp_cache_free();
+    for (size_t i = 0; i < 3; ++i) {
+        unlink(paths[i]);
+        free(strs[i]);
+    }
+}
+
+// Read back everything written to a temporary file, then empty it
+static char *read_tmp(FILE *fp)
+{
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    char *buf = malloc(len + 1);
+    rewind(fp);
+    assert(fread(buf, 1, len, fp) == (size_t) len);
+    buf[len] = 0;
+    rewind(fp);
+    assert(!ftruncate(fileno(fp), 0));
+    return buf;
+}
+
+// Write a file in a directory, returns its path
+static char *write_in(const char *dir, const char *name, const char *str)
+{
+    char *path;
+    assert(asprintf(&path, "%s/%s", dir, name) >= 0);
+    FILE *fp = fopen(path, "w");
+    assert(fp);
+    fputs(str, fp);
+    fclose(fp);
+    return path;
+}
+
+// Assert that headers are system headers by the directory they're found in,
+// or by being included from one, and not by the #include using <>
+static void assert_system_deps(void)
+{
+    char idir[] = "/tmp/test_ppXXXXXX", sdir[] = "/tmp/test_ppXXXXXX";
+    assert(mkdtemp(idir) && mkdtemp(sdir));
+    char *x = write_in(idir, "x.h", "x\n");
+    char *w = write_in(idir, "w.h", "w\n");
+    char *y = write_in(sdir, "y.h", "#include <w.h>\ny\n");
+
+    for (int system = 0; system < 2; ++system) {
+        PpContext *ctx = pp_create();
+        pp_add_system_dir(ctx, sdir);
+        pp_add_search_dir(ctx, idir);
+        pp_push_string(ctx, "test_deps.c", "#include <x.h>\n#include <y.h>\n");
+        pp_scan(ctx);
+        FILE *fp = tmpfile();
+        assert(fp);
+        pp_write_deps(ctx, fp, "m.o", system);
+        pp_free(ctx);
+
+        char *got = read_tmp(fp), *want;
+        if (system)
+            assert(asprintf(&want, "m.o: %s %s %s\n", x, y, w) >= 0);
+        else
+            assert(asprintf(&want, "m.o: %s\n", x) >= 0);
+        assert(!strcmp(got, want));
+        free(got);
+        free(want);
+        fclose(fp);
+    }
+
+    unlink(x);
+    unlink(w);
+    unlink(y);
+    rmdir(idir);
+    rmdir(sdir);
+    free(x);
+    free(w);
+    free(y);
+}
+
+// Assert that relative paths, of the main file, local headers and search
+// directories, are opened from the directory set instead of the working one
+static void assert_relative_dir(void)
+{
+    char dir[] = "/tmp/test_ppXXXXXX";
+    assert(mkdtemp(dir));
+    char *inc, *m = write_in(dir, "m.c", "#include \"h.h\"\n#include <y.h>\nm\n");
+    char *h = write_in(dir, "h.h", "h\n");
+    assert(asprintf(&inc, "%s/inc", dir) >= 0);
+    assert(!mkdir(inc, 0700));
+    char *y = write_in(inc, "y.h", "y\n");
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    assert(dirfd >= 0);
+
+    PpContext *ctx = pp_create();
+    pp_set_dir(ctx, dirfd);
+    pp_add_search_dir(ctx, "inc");
+    assert(!pp_push_file(ctx, "m.c"));
+    FILE *fp = tmpfile();
+    assert(fp);
+    pp_write(ctx, fileno(fp));
+    pp_free(ctx);
+
+    char *got = read_tmp(fp);
+    assert(!strcmp(got, "# 1 \"m.c\"\n"
+                        "# 1 \"h.h\" 1\nh\n"
+                        "# 2 \"m.c\" 2\n"
+                        "# 1 \"inc/y.h\" 1\ny\n"
+                        "# 3 \"m.c\" 2\nm\n"));
+    free(got);
+    fclose(fp);
+
+    close(dirfd);
+    unlink(m);
+    unlink(h);
+    unlink(y);
+    rmdir(inc);
+    rmdir(dir);
+    free(m);
+    free(h);
+    free(y);
+    free(inc);
+}
+
+// Write a main file from scratch, as pp_write_incremental should
+static char *full_output(const char *str)
+{
+    PpContext *ctx = pp_create();
+    pp_push_string(ctx, "test_incr.c", str);
+    FILE *fp = tmpfile();
+    assert(fp);
+    pp_write(ctx, fileno(fp));
+    pp_free(ctx);
+    char *buf = read_tmp(fp);
+    fclose(fp);
+    return buf;
+}
+
+// Write a main file again after an edit, checking the output against a full
+// run, and that it resumed after the offset given (if any)
+static void assert_incremental(PpContext *ctx, FILE *fp, const char *str,
+                               size_t after)
+{
+    size_t resumed = pp_write_incremental(ctx, "test_incr.c", str,
+        fileno(fp));
+    char *got = read_tmp(fp), *want = full_output(str);
+    assert(!strcmp(got, want));
+    assert(after ? resumed > after : !resumed);
+    free(got);
+    free(want);
+}
+
+// Assert that writing a main file again after edits, before and after
+// includes, definitions and inside conditionals, matches a full run
+static void assert_incremental_edits(void)
+{
+    char path[] = "/tmp/test_ppXXXXXX";
+    write_tmp(path,
+        "#ifndef H\n"
+        "#define H\n"
+        "#define G(a) [a]\n"
+        "#endif\n"
+        "header F(1)\n");
+
+    // Enough lines for checkpoints between the includes
+    StringBuilder lines;
+    sb_init(&lines);
+    for (int i = 0; i < 2000; ++i)
+        sb_addstr(&lines, "int x = F(x) + G(y);\n");
+    char *body = sb_str(&lines);
+
+    struct {
+        const char *str;
+        size_t     after;  // Quarters of the lines it resumes after
+    } edits[] = {
+        { "#define F(a) a\n" "#include \"%s\"\n" "%s"
+          "#if F(1)\n" "one\n" "#else\n" "zero\n" "#endif\n"
+          "#include \"%s\"\n" "#ifdef H\n" "%s" "#endif\n"
+          "end\n", 0 },
+        // Appending
+        { "#define F(a) a\n" "#include \"%s\"\n" "%s"
+          "#if F(1)\n" "one\n" "#else\n" "zero\n" "#endif\n"
+          "#include \"%s\"\n" "#ifdef H\n" "%s" "#endif\n"
+          "end more\n", 6 },
+        // Inside a conditional
+        { "#define F(a) a\n" "#include \"%s\"\n" "%s"
+          "#if F(0)\n" "one\n" "#else\n" "zero\n" "#endif\n"
+          "#include \"%s\"\n" "#ifdef H\n" "%s" "#endif\n"
+          "end more\n", 3 },
+        // Undefining a macro of the header before it's included again
+        { "#define F(a) a\n" "#include \"%s\"\n" "%s"
+          "#if F(0)\n" "one\n" "#else\n" "zero\n" "#undef G\n" "#endif\n"
+          "#include \"%s\"\n" "#ifdef H\n" "%s" "#endif\n"
+          "end more G(z)\n", 3 },
+        // The first line
+        { "#define F(a) (a)\n" "#include \"%s\"\n" "%s"
+          "#if F(0)\n" "one\n" "#else\n" "zero\n" "#undef G\n" "#endif\n"
+          "#include \"%s\"\n" "#ifdef H\n" "%s" "#endif\n"
+          "end more G(z)\n", 0 },
+    };
+
+    PpContext *ctx = pp_create();
+    FILE *fp = tmpfile();
+    assert(fp);
+    for (size_t i = 0; i < sizeof edits / sizeof *edits; ++i) {
+        char *str;
+        assert(asprintf(&str, edits[i].str, path, body, path, body) >= 0);
+        assert_incremental(ctx, fp, str, strlen(body) * edits[i].after / 4);
+        free(str);
+    }
+
+    // Editing the header goes back to before it was read
+    FILE *header = fopen(path, "w");
+    assert(header);
+    fputs("header changed F(2)\n", header);
+    fclose(header);
+    char *str;
+    assert(asprintf(&str, edits[0].str, path, body, path, body) >= 0);
+    assert_incremental(ctx, fp, str, 0);
+    free(str);
+
+    pp_free(ctx);
+    fclose(fp);
+    free(body);
+    unlink(path);
+}
+
+// Assert that tokens read through a pipe are the same as read directly, with
+// the same locations at the start of lines, and that the output is too
+static void assert_pipe_identical(const char *str)
+{
+    PpContext *ctx1 = pp_create(), *ctx2 = pp_create();
+    pp_push_string(ctx1, "test_pipe.c", str);
+    pp_push_string(ctx2, "test_pipe.c", str);
+    PpPipe *pipe = pp_pipe_start(ctx1);
+
+    Token *t1, *t2;
+    PpLocation loc1, loc2;
+    _Bool line_start = 1;
+    for (;;) {
+        t1 = pp_pipe_next(pipe);
+        t2 = pp_next(ctx2);
+        assert_identical(t1, t2);
+        if (!t1)
+            break;
+        assert(t1->flags.lwhite == t2->flags.lwhite);
+        if (line_start && t1->type != TK_NEW_LINE) {
+            assert(pp_pipe_location(pipe, &loc1) == pp_location(ctx2, &loc2));
+            assert(!strcmp(loc1.path, loc2.path) && loc1.line == loc2.line
+                && loc1.depth == loc2.depth);
+        }
+        line_start = t1->type == TK_NEW_LINE;
+        free_token(t1);
+        free_token(t2);
+    }
+    pp_pipe_free(pipe);
+    pp_free(ctx1);
+    pp_free(ctx2);
+
+    // Written through a pipe
+    PpContext *ctx = pp_create();
+    pp_push_string(ctx, "test_incr.c", str);
+    FILE *fp = tmpfile();
+    assert(fp);
+    pipe = pp_pipe_start(ctx);
+    pp_write_pipe(pipe, fileno(fp));
+    pp_pipe_free(pipe);
+    pp_free(ctx);
+    char *got = read_tmp(fp), *want = full_output(str);
+    assert(!strcmp(got, want));
+    free(got);
+    free(want);
+    fclose(fp);
+}
+
+static jmp_buf pipe_env;
+
+static void pipe_error(void *arg)
+{
+    (void) arg;
+    longjmp(pipe_env, 1);
+}
+
+// Assert that an error of the pre-processor thread is reported once the
+// tokens before it are read, and that a pipe can be freed early
+static void assert_pipe_error(const char *lines)
+{
+    char *str;
+    assert(asprintf(&str, "%s#error stop\nafter\n", lines) >= 0);
+    PpContext *ctx = pp_create();
+    FILE *err = tmpfile();
+    assert(err);
+    pp_set_err(ctx, err, pipe_error, NULL);
+    pp_push_string(ctx, "test_pipe.c", str);
+    PpPipe *pipe = pp_pipe_start(ctx);
+
+    // NOTE: volatile as it's assigned between setjmp and longjmp
+    volatile size_t n = 0;
+    if (!setjmp(pipe_env)) {
+        Token *token;
+        while ((token = pp_pipe_next(pipe))) {
+            assert(strcmp(token_spelling(token), "after"));
+            free_token(token);
+            ++n;
+        }
+        assert(0);
+    }
+    // Every token of the lines before it
+    assert(n == 3 * 3000);
+    pp_free(ctx);
+    fclose(err);
+
+    // Stopping after a few tokens
+    ctx = pp_create();
+    pp_push_string(ctx, "test_pipe.c", str);
+    pipe = pp_pipe_start(ctx);
+    for (size_t i = 0; i < 10; ++i)
+        free_token(pp_pipe_next(pipe));
+    pp_pipe_free(pipe);
+    pp_free(ctx);
+    free(str);
+}
+
+// Assert that entering and returning from headers is marked in the output,
+// like GCC does, with or without a pipe
+static void assert_include_markers(void)
+{
+    char s1[] = "/tmp/test_ppXXXXXX", s2[] = "/tmp/test_ppXXXXXX",
+         e[] = "/tmp/test_ppXXXXXX";
+    write_tmp(s1, "x\n");
+    // Headers without tokens are marked too
+    write_tmp(s2, "#define Y\n");
+    char *str, *want, *header;
+    assert(asprintf(&header, "#include \"%s\"\nz\n", s1) >= 0);
+    write_tmp(e, header);
+    assert(asprintf(&str,
+        "A\n"
+        "#include \"%s\"\n"
+        "#include \"%s\"\n"
+        "B\n"
+        "#include \"%s\"\n"
+        "C\n",
+        s1, s2, e) >= 0);
+    assert(asprintf(&want,
+        "# 1 \"test_out.c\"\n"
+        "A\n"
+        "# 1 \"%s\" 1\n"
+        "x\n"
+        "# 3 \"test_out.c\" 2\n"
+        "# 1 \"%s\" 1\n"
+        "# 4 \"test_out.c\" 2\n"
+        "B\n"
+        "# 1 \"%s\" 1\n"
+        "# 1 \"%s\" 1\n"
+        "x\n"
+        "# 2 \"%s\" 2\n"
+        "z\n"
+        "# 6 \"test_out.c\" 2\n"
+        "C\n",
+        s1, s2, e, s1, e) >= 0);
+    assert_output(str, want);
+    assert_pipe_identical(str);
+    free(want);
+    free(str);
+
+    // Starting with an #include marks the main file first
+    assert(asprintf(&str, "#include \"%s\"\nA\n", s2) >= 0);
+    assert(asprintf(&want,
+        "# 1 \"test_out.c\"\n"
+        "# 1 \"%s\" 1\n"
+        "# 2 \"test_out.c\" 2\n"
+        "A\n",
+        s2) >= 0);
+    assert_output(str, want);
+    free(want);
+    free(str);
+
+    free(header);
+    unlink(s1);
+    unlink(s2);
+    unlink(e);
+}
+
+// Assert that failing to write the output is reported instead of exiting,
+// with or without a pipe
+static void assert_write_error(_Bool piped)
+{
+    int fd = open("/dev/null", O_RDONLY);
+    assert(fd >= 0);
+    PpContext *ctx = pp_create();
+    pp_push_string(ctx, "test_write.c", "#define A 1\nA\n");
+    if (piped) {
+        PpPipe *pipe = pp_pipe_start(ctx);
+        assert(pp_write_pipe(pipe, fd) < 0 && errno == EBADF);
+        pp_pipe_free(pipe);
+    } else {
+        assert(pp_write(ctx, fd) < 0 && errno == EBADF);
+    }
+    pp_free(ctx);
+    close(fd);
+}
+
+// Assert that the output before an error is written out, before the error is
+// reported, with or without a pipe
+static void assert_error_output(_Bool piped)
+{
+    PpContext *ctx = pp_create();
+    FILE *err = tmpfile(), *fp = tmpfile();
+    assert(err && fp);
+    pp_set_err(ctx, err, pipe_error, NULL);
+    pp_push_string(ctx, "test_err.c", "int a;\nint b;\n#bad\nint c;\n");
+
+    if (!setjmp(pipe_env)) {
+        if (piped)
+            pp_write_pipe(pp_pipe_start(ctx), fileno(fp));
+        else
+            pp_write(ctx, fileno(fp));
+        assert(0);
+    }
+    char *got = read_tmp(fp), *msg = read_tmp(err);
+    assert(!strcmp(got, "# 1 \"test_err.c\"\nint a;\nint b;\n"));
+    assert(!strncmp(msg, "Error: test_err.c:3: ", 21));
+    free(got);
+    free(msg);
+    pp_free(ctx);
+    fclose(fp);
+    fclose(err);
+}
+
+// Assert that pre-processing on a thread of its own changes nothing, over
+// enough tokens for many batches
+static void assert_pipe(void)
+{
+    char path[] = "/tmp/test_ppXXXXXX";
+    write_tmp(path,
+        "#define G(a) [a]\n"
+        "header G(1)\n");
+
+    StringBuilder lines;
+    sb_init(&lines);
+    for (int i = 0; i < 3000; ++i)
+        sb_addstr(&lines, "x;\n");
+    char *body = sb_str(&lines);
+
+    char *str;
+    assert(asprintf(&str,
+        "#define F(a) a + G(a)\n"
+        "#include \"%s\"\n"
+        "%s"
+        "F(1) F(F(2))\n"
+        "#include \"%s\"\n"
+        "\n\n\n"
+        "__LINE__ F(\n"
+        "3)\n",
+        path, body, path) >= 0);
+    assert_pipe_identical(str);
+    assert_pipe_error(body);
+
+    free(str);
+    free(body);
+    unlink(path);
+}
+
 int main(void)
 {
     assert_identical_result(
@@ -146,5 +824,132 @@ int main(void)
         "\n"
         "X\n"
     );
-}
 
+    assert_identical_result(
+        // Parameters used more than once share one pre-expansion
+        "#define MAX(a, b) ((a) > (b) ? (a) : (b))\n"
+        "#define CHECK(x) if (!(x)) fail(#x, x)\n"
+        "#define ONE 1\n"
+        "MAX(MAX(ONE, 2), MAX(3, ONE))\n"
+        "CHECK(ONE == MAX(ONE, 0));\n",
+        // Expected result
+        "((((1) > (2) ? (1) : (2))) > (((3) > (1) ? (3) : (1))) ?"
+        " (((1) > (2) ? (1) : (2))) : (((3) > (1) ? (3) : (1))))\n"
+        "if (!(1 == ((1) > (0) ? (1) : (0)))) fail(\"ONE == MAX(ONE, 0)\","
+        " 1 == ((1) > (0) ? (1) : (0)));\n"
+    );
+
+    assert_identical_result(
+        // Hidesets of nested and closing parenthesis dependent expansions
+        "#define f(a) a*g\n"
+        "#define g(a) f(a)\n"
+        "#define LP (\n"
+        "#define RP )\n"
+        "#define F(x) F x\n"
+        "f(2)(9)\n"
+        "F LP 1 RP RP\n",
+        // Expected result
+        "2*9*g\n"
+        "F ( 1 ) )\n"
+    );
+
+    assert_identical_result(
+        // Invocations split over lines, the newlines in them are dropped
+        "#define F(a) [a]\n"
+        "F(\n"
+        "1) F(\n"
+        "2\n"
+        ") F\n"
+        "\n"
+        "(3)\n",
+        // Expected result
+        "[1] [2] [3]\n"
+    );
+
+    assert_identical_result(
+        // Skipped lines are not lexed, but comments and literals still hide
+        // directive names
+        "#if 0\n"
+        "/*\n"
+        "#endif */ \"#endif\" '\"' // \"\n"
+        "# /* */ ifdef x y\n"
+        "#endif z\n"
+        "#else\n"
+        "ok\n"
+        "#endif\n",
+        // Expected result
+        "ok\n"
+    );
+
+    assert_identical_result(
+        // Dead operands are parsed but not evaluated, invocations in them are
+        // skipped without expanding them
+        "#define F(x) x / 0\n"
+        "#define G(x) (x\n"
+        "#define OR ||\n"
+        "#if 0 && 1 / 0\n"
+        "a\n"
+        "#elif 1 || F(G(1)) % 0\n"
+        "b\n"
+        "#endif\n"
+        "#if 0 ? F((1, 2)) : 1 ? 2 : 1 / 0\n"
+        "c\n"
+        "#endif\n"
+        "#if 0 && F(1) OR 0 || 1\n"
+        "d\n"
+        "#endif\n",
+        // Expected result
+        "b\n"
+        "c\n"
+        "d\n"
+    );
+
+    assert_output(
+        // Short line jumps are kept as blank lines, long ones become markers
+        "#define A 1\n"
+        "A\n"
+        "\n\n"
+        "x\n"
+        "\n\n\n\n\n\n\n\n\n\n"
+        "y z\n",
+        // Expected output
+        "# 2 \"test_out.c\"\n"
+        "1\n"
+        "\n\n"
+        "x\n"
+        "# 16 \"test_out.c\"\n"
+        "y z\n"
+    );
+
+    assert_memo_identical(
+        // Memoized expansions depend on the macros they looked up, and not on
+        // anything after them
+        "#define REG(x) (*(unsigned *) (BASE + (x)))\n"
+        "#define BASE 0x1000\n"
+        "#define STR(x) #x\n"
+        "#define XSTR(x) STR(x)\n"
+        "#define G(x) H\n"
+        "#define H(x) [x]\n"
+        "#define L __LINE__\n"
+        "#define ID(x) x\n"
+        "REG(0x10) REG(0x10)REG( 0x10)\n"
+        "#undef BASE\n"
+        "#define BASE 0x2000\n"
+        "REG(0x10) XSTR(REG(1)) XSTR(REG(1)) XSTR(REG( 1))\n"
+        "G(1)(2) G(1)(2) ID(L) ID(L) ID(ID)(3) ID(ID)(3)\n"
+        "ID(ID(BASE) G(1)) (4) ID(ID(BASE) G(1)) (4)\n");
+
+    assert_if_memo();
+    assert_skip_index();
+    assert_system_deps();
+    assert_relative_dir();
+    assert_cache_edit();
+    assert_cache_evict();
+    assert_incremental_edits();
+    assert_pipe();
+    assert_include_markers();
+    assert_error_output(0);
+    assert_error_output(1);
+    assert_write_error(0);
+    assert_write_error(1);
+}
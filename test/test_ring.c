@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Ring tests
+ *
+ * A producer thread fills numbered slots of a small ring faster or slower
+ * than the consumer reads them, checking that they come out in order, and
+ * that it's held back by a full ring. Run with "bench" as argument to time
+ * handing slots over instead.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ring.h>
+
+typedef struct {
+    size_t seq;
+    size_t data[7];
+} Slot;
+
+#define NSLOTS 4
+
+RING_GEN(Slot, NSLOTS, SlotRing, slot_ring)
+
+typedef struct {
+    SlotRing ring;
+    size_t   count;     // Slots to commit before closing (or cancelled)
+    _Bool    slow;      // Sleep between slots?
+    size_t   committed; // Slots committed
+} Producer;
+
+static void *produce(void *arg)
+{
+    Producer *p = arg;
+    Slot *slot;
+    for (size_t i = 0; i < p->count && (slot = slot_ring_write_slot(&p->ring));
+            ++i) {
+        slot->seq = i;
+        for (size_t j = 0; j < 7; ++j)
+            slot->data[j] = i * j;
+        if (p->slow && i % 64 == 0)
+            usleep(100);
+        slot_ring_commit(&p->ring);
+        __atomic_store_n(&p->committed, i + 1, __ATOMIC_SEQ_CST);
+    }
+    slot_ring_close(&p->ring);
+    return NULL;
+}
+
+// Read every slot, slowly or not, checking the order
+static void test_order(_Bool slow_producer, _Bool slow_consumer)
+{
+    enum { COUNT = 2000 };
+    Producer p = { .count = COUNT, .slow = slow_producer };
+    slot_ring_init(&p.ring);
+    pthread_t thread;
+    assert(!pthread_create(&thread, NULL, produce, &p));
+
+    Slot *slot;
+    size_t n = 0;
+    while ((slot = slot_ring_read_slot(&p.ring))) {
+        assert(slot->seq == n && slot->data[6] == n * 6);
+        // The producer is at most a ring ahead
+        assert(__atomic_load_n(&p.committed, __ATOMIC_SEQ_CST) <= n + NSLOTS);
+        if (slow_consumer && n % 64 == 0)
+            usleep(100);
+        slot_ring_release(&p.ring);
+        ++n;
+    }
+    assert(n == COUNT);
+    // Reading past the end keeps returning NULL
+    assert(!slot_ring_read_slot(&p.ring));
+
+    pthread_join(thread, NULL);
+    slot_ring_free(&p.ring);
+}
+
+// Cancel the ring with the producer blocked on it
+static void test_cancel(void)
+{
+    Producer p = { .count = (size_t) -1 };
+    slot_ring_init(&p.ring);
+    pthread_t thread;
+    assert(!pthread_create(&thread, NULL, produce, &p));
+
+    for (size_t i = 0; i < 10; ++i) {
+        Slot *slot = slot_ring_read_slot(&p.ring);
+        assert(slot && slot->seq == i);
+        slot_ring_release(&p.ring);
+    }
+    while (__atomic_load_n(&p.committed, __ATOMIC_SEQ_CST) < 10 + NSLOTS)
+        usleep(100);
+    slot_ring_cancel(&p.ring);
+    pthread_join(thread, NULL);
+    assert(p.committed == 10 + NSLOTS);
+    slot_ring_free(&p.ring);
+}
+
+static void bench(void)
+{
+    enum { COUNT = 200000 };
+    Producer p = { .count = COUNT };
+    slot_ring_init(&p.ring);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t thread;
+    assert(!pthread_create(&thread, NULL, produce, &p));
+    size_t sum = 0;
+    Slot *slot;
+    while ((slot = slot_ring_read_slot(&p.ring))) {
+        sum += slot->seq;
+        slot_ring_release(&p.ring);
+    }
+    pthread_join(thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    slot_ring_free(&p.ring);
+
+    double time = end.tv_sec - start.tv_sec
+        + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d slots of %zu bytes through %d (checksum %zu)\n", COUNT,
+        sizeof (Slot), NSLOTS, sum);
+    printf("  %8.3f ms, %5.1f ns/slot\n", time * 1e3, time * 1e9 / COUNT);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && !strcmp(argv[1], "bench")) {
+        bench();
+        return 0;
+    }
+    test_order(0, 0);
+    test_order(1, 0);
+    test_order(0, 1);
+    test_cancel();
+}
@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Server tests
+ *
+ * A server thread runs a command echoing its command line to stdout and a
+ * variable of its environment to stderr, from the directory it's given.
+ * Clients check that all of it comes back along with the exit status, while
+ * other connections stall or send requests the server must drop.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <server.h>
+
+static char sock_path[64];
+
+static int echo_command(int dirfd, char *envp[], int argc, char *argv[],
+                        FILE *out, FILE *err)
+{
+    // Relative paths are the client's
+    assert(!faccessat(dirfd, "client_dir", F_OK, 0));
+    for (int i = 0; i < argc; ++i)
+        fprintf(out, "%s\n", argv[i]);
+    for (; *envp; ++envp)
+        if (!strncmp(*envp, "TEST_SERVER=", 12))
+            fprintf(err, "%s\n", *envp);
+    return argc;
+}
+
+static void *serve(void *arg)
+{
+    (void) arg;
+    server_run(sock_path, echo_command);
+    // Returns only on failure
+    abort();
+}
+
+// Connect to the server, once it's listening
+static int connect_server(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, sock_path);
+    for (;;) {
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        assert(sock >= 0);
+        if (!connect(sock, (struct sockaddr *) &addr, sizeof addr))
+            return sock;
+        close(sock);
+        usleep(1000);
+    }
+}
+
+// Read back everything written to a temporary file, then close it
+static char *read_tmp(FILE *fp)
+{
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    char *buf = malloc(len + 1);
+    rewind(fp);
+    assert(fread(buf, 1, len, fp) == (size_t) len);
+    buf[len] = 0;
+    fclose(fp);
+    return buf;
+}
+
+// Run a client, returns its exit status and what it wrote to stdout and stderr
+static int run_client(int argc, char *argv[], char **out, char **err)
+{
+    FILE *out_fp = tmpfile(), *err_fp = tmpfile();
+    assert(out_fp && err_fp);
+    int stdout_fd = dup(STDOUT_FILENO), stderr_fd = dup(STDERR_FILENO);
+    fflush(stdout);
+    fflush(stderr);
+    dup2(fileno(out_fp), STDOUT_FILENO);
+    dup2(fileno(err_fp), STDERR_FILENO);
+
+    int status = client_run(sock_path, argc, argv);
+
+    dup2(stdout_fd, STDOUT_FILENO);
+    dup2(stderr_fd, STDERR_FILENO);
+    close(stdout_fd);
+    close(stderr_fd);
+    *out = read_tmp(out_fp);
+    *err = read_tmp(err_fp);
+    return status;
+}
+
+// The command line, working directory and environment get to the command,
+// its output and exit status back to the client
+static void test_round_trip(void)
+{
+    char *argv[] = { "mcc", "-E", "a b", "" }, *out, *err;
+    setenv("TEST_SERVER", "x=1", 1);
+    assert(run_client(4, argv, &out, &err) == 4);
+    assert(!strcmp(out, "mcc\n-E\na b\n\n"));
+    assert(!strcmp(err, "TEST_SERVER=x=1\n"));
+    free(out);
+    free(err);
+    unsetenv("TEST_SERVER");
+}
+
+// Request written by hand
+typedef struct {
+    char buf[64];
+    size_t len;
+} Request;
+
+static void put_u32(Request *req, uint32_t val)
+{
+    memcpy(req->buf + req->len, &val, sizeof val);
+    req->len += sizeof val;
+}
+
+static void put_str(Request *req, const char *str)
+{
+    put_u32(req, strlen(str));
+    memcpy(req->buf + req->len, str, strlen(str));
+    req->len += strlen(str);
+}
+
+// Send a request, then wait for the server to drop it
+static void assert_dropped(const Request *req)
+{
+    int sock = connect_server();
+    assert(write(sock, req->buf, req->len) == (ssize_t) req->len);
+    char c;
+    ssize_t n = read(sock, &c, 1);
+    assert(n == 0 || (n < 0 && errno == ECONNRESET));
+    close(sock);
+}
+
+// Lengths and counts the server can't hold, or without a command line
+static void test_bad_requests(void)
+{
+    Request reqs[5] = { 0 };
+    put_u32(reqs, UINT32_MAX);
+    put_u32(reqs + 1, 1 << 20);
+    put_str(reqs + 2, "/");
+    put_u32(reqs + 2, UINT32_MAX);
+    put_str(reqs + 3, "/");
+    put_u32(reqs + 3, 1 << 20);
+    put_str(reqs + 4, "/");
+    put_u32(reqs + 4, 0);
+    put_u32(reqs + 4, 0);
+    for (size_t i = 0; i < 5; ++i)
+        assert_dropped(reqs + i);
+}
+
+// A connection that doesn't send its request holds no one else up
+static void test_stalled(void)
+{
+    int sock = connect_server();
+    char *argv[] = { "mcc" }, *out, *err;
+    assert(run_client(1, argv, &out, &err) == 1);
+    assert(!strcmp(out, "mcc\n"));
+    free(out);
+    free(err);
+    close(sock);
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/test_serverXXXXXX", *client_dir;
+    assert(mkdtemp(dir));
+    snprintf(sock_path, sizeof sock_path, "%s/sock", dir);
+    assert(asprintf(&client_dir, "%s/client_dir", dir) >= 0);
+    assert(!mkdir(client_dir, 0700));
+
+    pthread_t thread;
+    assert(!pthread_create(&thread, NULL, serve, NULL));
+    pthread_detach(thread);
+    close(connect_server());
+
+    // The command finds client_dir relative to the client's directory
+    assert(!chdir(dir));
+    test_round_trip();
+    test_bad_requests();
+    test_stalled();
+
+    unlink(sock_path);
+    rmdir(client_dir);
+    rmdir(dir);
+    free(client_dir);
+}